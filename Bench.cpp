@@ -0,0 +1,424 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+}
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include "Bench.h"
+#include "Pid.h"
+#include "PidTable.h"
+#include "ProcReader.h"
+#include "Scanner.h"
+#include "ProcUring.h"
+#include "PidSchema.h"
+#include "Pgsql.h"
+#include "Clock.h"
+#include "TextScan.h"
+
+vector<string> Bench::listPids(void) {
+	vector<string> names;
+
+	int fd = dup(ProcReader::getRootFd());
+	DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+	if (dir == NULL) {
+		perror("fdopendir");
+		return names;
+	}
+
+	dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] >= '0' && entry->d_name[0] <= '9') {
+			names.push_back(entry->d_name);
+		}
+	}
+	closedir(dir);
+
+	return names;
+}
+
+double Bench::elapsed(const struct timespec &start) {
+	timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+// Check every TextScan level the CPU supports against the scalar kernels,
+// on buffers of every length up to a few blocks at every alignment and on
+// a long cmdline, then time each level on that cmdline and a stat line
+int Bench::kernels(unsigned rounds) {
+	static const char alphabet[] = { 'a', '1', ' ', ' ', '\0', ')', '(', '\n' };
+	static const size_t field_max = 64;
+	uint32_t seed = 1;
+	string data;
+	for (size_t i = 0; i < 256; ++i) {
+		seed = seed * 1103515245 + 12345;
+		data += alphabet[(seed >> 16) % sizeof(alphabet)];
+	}
+
+	TextScan::Level best = TextScan::getLevel();
+	size_t mismatches = 0, checked = 0;
+	for (int l = TextScan::SSE2; l < TextScan::LEVELS; ++l) {
+		TextScan::Level level = TextScan::Level(l);
+		if (TextScan::supported(level) == false)
+			continue;
+
+		for (size_t offset = 0; offset < 32; ++offset) {
+			for (size_t length = 0; offset + length <= data.size(); ++length) {
+				const char *in = data.data() + offset;
+				string expect(in, length), got(in, length);
+				const char *expect_fields[field_max], *got_fields[field_max];
+
+				TextScan::setLevel(TextScan::SCALAR);
+				TextScan::nulToSpace(&expect[0], length);
+				const char *expect_last = TextScan::findLast(in, length, ')');
+				size_t expect_count = TextScan::splitFields(in, length,
+						expect_fields, field_max);
+
+				TextScan::setLevel(level);
+				TextScan::nulToSpace(&got[0], length);
+				const char *got_last = TextScan::findLast(in, length, ')');
+				size_t got_count = TextScan::splitFields(in, length,
+						got_fields, field_max);
+
+				bool same = got == expect && got_last == expect_last
+						&& got_count == expect_count
+						&& equal(got_fields, got_fields + got_count,
+								expect_fields);
+				if (same == false && mismatches++ < 10) {
+					cerr << TextScan::name(level) << " differs from scalar at "
+							<< "offset " << offset << " length " << length
+							<< endl;
+				}
+				++checked;
+			}
+		}
+	}
+	TextScan::setLevel(best);
+	cout << "kernels: " << checked << " inputs checked against scalar, "
+			<< mismatches << " mismatches" << endl;
+
+	// A JVM sized command line, and a stat line of a kernel thread
+	string cmdline;
+	while (cmdline.size() < 128 * 1024) {
+		cmdline += "-Dspark.executor.extraClassPath=/opt/spark/jars/lib.jar";
+		cmdline += '\0';
+	}
+	string stat = "2 (kthreadd) S 0 0 0 0 -1 2129984 0 0 0 0 0 62 0 0 20 0 1 0"
+			" 7 0 0 18446744073709551615 0 0 0 0 0 0 0 2147483647 0 0 0 0 0 0"
+			" 0 0 0 0 0 0 0 0 0 0 0\n";
+
+	for (int l = TextScan::SCALAR; l < TextScan::LEVELS; ++l) {
+		TextScan::Level level = TextScan::Level(l);
+		if (TextScan::supported(level) == false)
+			continue;
+		TextScan::setLevel(level);
+
+		string buffer;
+		timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (unsigned round = 0; round < rounds * 100; ++round) {
+			buffer = cmdline;
+			TextScan::nulToSpace(&buffer[0], buffer.size());
+		}
+		double cmdline_ns = elapsed(start) / (rounds * 100);
+
+		const char *fields[20];
+		size_t found = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (unsigned round = 0; round < rounds * 10000; ++round) {
+			const char *close = TextScan::findLast(stat.data(), stat.size(),
+					')');
+			found += TextScan::splitFields(close + 1,
+					stat.data() + stat.size() - close - 1, fields, 20);
+		}
+		double stat_ns = elapsed(start) / (rounds * 10000);
+
+		cout << "kernels " << TextScan::name(level) << ": " << cmdline.size()
+				<< " byte cmdline " << cmdline_ns / 1e3 << " us, stat line "
+				<< stat_ns << " ns (" << found / (rounds * 10000) << " fields)"
+				<< endl;
+	}
+	TextScan::setLevel(best);
+
+	return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Cost of building a Pid (reading and parsing cmdline, comm and stat), and
+// of a whole scan with the given number of threads
+int Bench::parse(unsigned rounds, unsigned threads) {
+	vector<string> names = listPids();
+	if (names.empty()) {
+		cerr << "No processes found to parse" << endl;
+		return EXIT_FAILURE;
+	}
+
+	// Warm the dentry cache and the per-thread read buffer
+	size_t valid = 0;
+	for (vector<string>::iterator i = names.begin(); i != names.end(); ++i) {
+		valid += Pid(i->c_str()).valid();
+	}
+
+	timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned round = 0; round < rounds; ++round) {
+		for (vector<string>::iterator i = names.begin(); i != names.end(); ++i) {
+			Pid p(i->c_str());
+		}
+	}
+	double ns = elapsed(start);
+
+	size_t parsed = size_t(rounds) * names.size();
+	cout << "parse: " << names.size() << " processes (" << valid
+			<< " readable) x " << rounds << " rounds, " << ns / parsed
+			<< " ns/process, " << ns / rounds / 1e6 << " ms/scan" << endl;
+
+	Scanner scanner(threads);
+	PidTable pids;
+	scanner.scan(pids);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned round = 0; round < rounds; ++round) {
+		scanner.scan(pids);
+	}
+	ns = elapsed(start);
+
+	cout << "scan: " << pids.size() << " processes with "
+			<< scanner.getThreads() << " threads"
+			<< (ProcUring::available() ? " and io_uring" : "") << ", "
+			<< ns / rounds / 1e6 << " ms/scan" << endl;
+
+	return EXIT_SUCCESS;
+}
+
+// Cost of filling a row of parameters: once through each addCol() overload,
+// once through PidSchema::write() into declared columns, and of building
+// the INSERT for a table of every pids column
+int Bench::prepare(unsigned rounds, unsigned threads) {
+	Scanner scanner(threads);
+	PidTable pids;
+	scanner.scan(pids);
+	if (pids.empty()) {
+		cerr << "No processes found to write" << endl;
+		return EXIT_FAILURE;
+	}
+
+	// No connection is needed until exec()
+	Prepare named(NULL, "bench_named");
+	named.setTableName("pids");
+	string text = "/usr/bin/bench --option value";
+	char chars[] = "/usr/bin/bench";
+	size_t rows = size_t(rounds) * pids.size();
+
+	timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t row = 0; row < rows; ++row) {
+		named.addCol("cmdline", text);
+		named.addCol("comm", chars);
+		named.addCol("state", 'S');
+		named.addCol("set_id", uint64_t(row));
+		named.addCol("utime", int64_t(row));
+		named.addCol("pid", uint32_t(row));
+		named.addCol("nice", int32_t(row));
+		named.endRow();
+	}
+	double ns = elapsed(start);
+	cout << "addCol: " << rows << " rows of 7 columns, " << ns / rows
+			<< " ns/row, " << ns / rows / 7 << " ns/column" << endl;
+
+	Prepare declared(NULL, "bench_declared");
+	declared.setTableName("pids");
+	declared.declareCol("set_id", INT8OID);
+	PidSchema::declare(declared);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned round = 0; round < rounds; ++round) {
+		for (size_t i = 0; i < pids.size(); ++i) {
+			declared.add(int64_t(round));
+			PidSchema::write(declared, pids, i);
+			declared.endRow();
+		}
+	}
+	ns = elapsed(start);
+	cout << "add: " << rows << " rows of " << declared.params.size()
+			<< " columns, " << ns / rows << " ns/row" << endl;
+
+	size_t length = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t row = 0; row < rows; ++row) {
+		length += declared.generateInsertQuery().size();
+	}
+	ns = elapsed(start);
+	cout << "generateInsertQuery: " << length / rows << " bytes, " << ns / rows
+			<< " ns/query" << endl;
+
+	return EXIT_SUCCESS;
+}
+
+// End to end: scan and store rounds keyframe sets with each writer and
+// report sets per second. The insert writer's time per row is mostly
+// Prepare::exec(). Every set gets a node name of its own so that sets
+// taken within the same microsecond do not collide in pid_sets; run it against
+// a scratch database, the sets are left in place.
+int Bench::store(Pgsql &db, unsigned rounds, unsigned threads,
+		const string &nodename) {
+	static const struct {
+		const char *name;
+		SetWriter::Method method;
+	} writers[] = { { "copy", SetWriter::COPY },
+			{ "copy-text", SetWriter::COPY_TEXT },
+			{ "insert", SetWriter::INSERT } };
+
+	Scanner scanner(threads);
+	PidTable pids;
+	vector<Delta::Row> rows;
+	scanner.scan(pids);
+
+	int status = EXIT_SUCCESS;
+	for (size_t w = 0; w < sizeof(writers) / sizeof(writers[0]); ++w) {
+		size_t stored = 0, written = 0;
+		double store_ns = 0;
+		timespec start, set_start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (unsigned round = 0; round < rounds; ++round) {
+			scanner.scan(pids);
+			rows.resize(pids.size());
+			for (size_t i = 0; i < pids.size(); ++i) {
+				rows[i].change = 0;
+				rows[i].table = &pids;
+				rows[i].row = i;
+			}
+
+			stringstream name;
+			name << nodename << ".bench." << writers[w].name << "." << round;
+			Clock node_time;
+			clock_gettime(CLOCK_MONOTONIC, &set_start);
+			if (SetWriter::write(db, name.str(), node_time, true, rows,
+					writers[w].method)) {
+				++stored;
+				written += rows.size();
+			}
+			store_ns += elapsed(set_start);
+		}
+		double ns = elapsed(start);
+
+		cout << "store " << writers[w].name << ": " << stored << " of "
+				<< rounds << " sets, " << stored / (ns / 1e9) << " sets/s, "
+				<< (written > 0 ? store_ns / written / 1e3 : 0) << " us/row"
+				<< endl;
+		if (stored < rounds) {
+			status = EXIT_FAILURE;
+		}
+	}
+
+	return status;
+}
+
+bool Bench::writeFile(const string &path, const string &contents) {
+	int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			0644);
+	if (fd == -1) {
+		perror(path.c_str());
+		return false;
+	}
+	bool ok = write(fd, contents.data(), contents.size())
+			== ssize_t(contents.size());
+	if (ok == false) {
+		perror(path.c_str());
+	}
+	close(fd);
+	return ok;
+}
+
+// Write a proc-shaped tree of processes under root with the cmdline, comm
+// and stat files that Pid reads. Every tenth process is a kernel thread
+// with an empty cmdline; the others have NUL separated arguments of about
+// cmdline_size bytes. The values are pseudo-random but the same on every
+// run, so trees made with the same arguments compare.
+int Bench::makeProc(const string &root, unsigned processes,
+		size_t cmdline_size) {
+	if (mkdir(root.c_str(), 0755) == -1 && errno != EEXIST) {
+		perror(root.c_str());
+		return EXIT_FAILURE;
+	}
+
+	uint32_t seed = 1;
+	for (unsigned pid = 1; pid <= processes; ++pid) {
+		stringstream dir;
+		dir << root << "/" << pid;
+		if (mkdir(dir.str().c_str(), 0755) == -1 && errno != EEXIST) {
+			perror(dir.str().c_str());
+			return EXIT_FAILURE;
+		}
+
+		bool kthread = pid % 10 == 0;
+		stringstream comm;
+		comm << (kthread ? "kworker/" : "bench") << pid;
+
+		string cmdline;
+		if (kthread == false) {
+			cmdline = "/usr/bin/" + comm.str();
+			while (cmdline.size() < cmdline_size) {
+				seed = seed * 1103515245 + 12345;
+				stringstream arg;
+				arg << '\0' << "--option-" << (seed >> 16) % 1000 << "=value";
+				cmdline += arg.str();
+			}
+			cmdline.resize(max(cmdline_size, size_t(1)));
+			cmdline += '\0';
+		}
+
+		seed = seed * 1103515245 + 12345;
+		uint32_t r = seed >> 8;
+		stringstream stat;
+		stat << pid << " (" << comm.str().substr(0, 15) << ") "
+				<< "SRDI"[r % 4] << " " << (kthread ? 2 : 1) << " " << pid
+				<< " " << pid << " 0 -1 " << (kthread ? 69238880 : 4194560)
+				<< " " << r % 100000 << " " << r % 7000 << " " << r % 50
+				<< " " << r % 5 << " " << r % 30000 << " " << r % 9000
+				<< " " << r % 100 << " " << r % 40 << " 20 0 "
+				<< 1 + r % 16 << " 0 " << 1000 + pid * 10 << " "
+				<< (kthread ? 0 : 4096 * (1000 + r % 100000)) << " "
+				<< (kthread ? 0 : 100 + r % 50000);
+		// The remaining fields are not read but keep the line realistic
+		for (unsigned field = 25; field <= 52; ++field) {
+			stat << " 0";
+		}
+		stat << "\n";
+
+		if (writeFile(dir.str() + "/cmdline", cmdline) == false
+				|| writeFile(dir.str() + "/comm", comm.str() + "\n") == false
+				|| writeFile(dir.str() + "/stat", stat.str()) == false) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	cout << "Wrote " << processes << " processes to " << root << endl;
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <string>
+#include <vector>
+#include "SetWriter.h"
+
+using namespace std;
+
+class Pgsql;
+
+// Microbenchmarks run with --bench instead of taking a snapshot, and the
+// synthetic /proc tree they can run against (--make-proc, --proc-root)
+class Bench {
+private:
+	static vector<string> listPids(void);
+	static double elapsed(const struct timespec &start);
+	static bool writeFile(const string &path, const string &contents);
+
+public:
+	static int kernels(unsigned rounds);
+	static int parse(unsigned rounds, unsigned threads);
+	static int prepare(unsigned rounds, unsigned threads);
+	static int store(Pgsql &db, unsigned rounds, unsigned threads,
+			const string &nodename);
+	static int makeProc(const string &root, unsigned processes,
+			size_t cmdline_size);
+};
+
+#endif /* BENCH_H_ */
@@ -17,16 +17,65 @@
  *
  */
 
+extern "C" {
+#include <stdio.h>
+}
+
 #include "Clock.h"
 
-Clock::Clock() {
-	// TODO Auto-generated constructor stub
-	time(&local);
-	timeinfo = localtime(&local);
-	str = string(asctime (timeinfo));
+static const int64_t nsec_per_sec = 1000000000;
+// 2000-01-01 UTC, the epoch of PostgreSQL timestamps
+static const int64_t pg_epoch = 946684800;
+
+static int64_t now(clockid_t clock) {
+	timespec ts;
+	clock_gettime(clock, &ts);
+	return int64_t(ts.tv_sec) * nsec_per_sec + ts.tv_nsec;
+}
+
+Clock::Clock() :
+		realtime(now(CLOCK_REALTIME)), monotonic(now(CLOCK_MONOTONIC)) {
+}
+
+// A time from elsewhere, nanoseconds since 1970-01-01 UTC
+Clock::Clock(int64_t realtime) :
+		realtime(realtime), monotonic(0) {
 }
 
 Clock::~Clock() {
-	// TODO Auto-generated destructor stub
 }
 
+time_t Clock::seconds(void) const {
+	return realtime / nsec_per_sec;
+}
+
+int64_t Clock::nanoseconds(void) const {
+	return realtime;
+}
+
+int64_t Clock::getMonotonic(void) const {
+	return monotonic;
+}
+
+// Microseconds since 2000-01-01 UTC, a binary timestamptz
+int64_t Clock::pgMicroseconds(void) const {
+	return realtime / 1000 - pg_epoch * 1000000;
+}
+
+// ISO 8601 in UTC with microseconds, for servers that take timestamps as
+// text only
+string Clock::text(void) const {
+	time_t secs = seconds();
+	tm utc;
+	gmtime_r(&secs, &utc);
+	char buffer[40];
+	size_t n = strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &utc);
+	snprintf(buffer + n, sizeof(buffer) - n, ".%06d+00",
+			int(realtime % nsec_per_sec / 1000));
+	return string(buffer);
+}
+
+// CLOCK_BOOTTIME, the clock /proc/#/stat's starttime counts on
+int64_t Clock::sinceBoot(void) {
+	return now(CLOCK_BOOTTIME);
+}
@@ -20,19 +20,32 @@
 #ifndef CLOCK_H_
 #define CLOCK_H_
 
+extern "C" {
+#include <stdint.h>
 #include <time.h>
-#include <iostream>
+}
+
+#include <string>
 
 using namespace std;
 
+// A point in time in nanoseconds: the wall clock for timestamps and, when
+// it was taken here, the monotonic clock for measuring intervals. Nothing
+// is formatted until text() is asked for.
 class Clock {
 private:
-	time_t local;
-	tm *timeinfo;
+	int64_t realtime;	// CLOCK_REALTIME
+	int64_t monotonic;	// CLOCK_MONOTONIC, 0 if not taken here
 public:
 	Clock();
+	explicit Clock(int64_t realtime);
 	virtual ~Clock();
-	string str;
+	time_t seconds(void) const;
+	int64_t nanoseconds(void) const;
+	int64_t getMonotonic(void) const;
+	int64_t pgMicroseconds(void) const;
+	string text(void) const;
+	static int64_t sinceBoot(void);
 };
 
 #endif /* CLOCK_H_ */
@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <endian.h>
+}
+
+#include <iostream>
+#include <fstream>
+#include "Cmdlines.h"
+#include "Pgsql.h"
+#include "PidSchema.h"
+
+string Cmdlines::path;
+unordered_map<string, int64_t> Cmdlines::ids;
+mutex Cmdlines::lock;
+bool Cmdlines::dirty = false;
+
+static const char cmdlines_magic[8] = { 'P', 'I', 'D', 'C', 'M', 'D', 'S', '1' };
+
+// Hosts whose command lines never repeat would grow the cache without
+// bound; past this many it starts over
+static const size_t cmdlines_max = 65536;
+
+// Command lines looked up per statement, two parameters each
+static const size_t cmdlines_chunk = 1000;
+
+// FNV-1a, 64 bit
+int64_t Cmdlines::hash(const string &text) {
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < text.size(); ++i) {
+		hash ^= uint8_t(text[i]);
+		hash *= 1099511628211ull;
+	}
+	return int64_t(hash);
+}
+
+// Start interning with the cache file at path. A missing or unreadable
+// cache is not an error, the ids are looked up again.
+bool Cmdlines::open(const string &path) {
+	lock_guard<mutex> guard(lock);
+	Cmdlines::path = path;
+	ids.clear();
+	if (load() == false) {
+		ids.clear();
+		dirty = true;
+	}
+	return true;
+}
+
+bool Cmdlines::enabled(void) {
+	return path.empty() == false;
+}
+
+// The cache file is the magic, then for each command line its id as a
+// big-endian int64 and its length as a big-endian uint32 before the text
+bool Cmdlines::load(void) {
+	ifstream in(path.c_str(), ios::binary);
+	if (in.is_open() == false)
+		return false;
+
+	char magic[sizeof(cmdlines_magic)];
+	if (in.read(magic, sizeof(magic)).gcount() != sizeof(magic)
+			|| memcmp(magic, cmdlines_magic, sizeof(magic)) != 0) {
+		cerr << path << " is not a cmdline cache, starting a new one" << endl;
+		return false;
+	}
+
+	string text;
+	for (;;) {
+		uint64_t id;
+		uint32_t length;
+		if (in.read(reinterpret_cast<char *>(&id), sizeof(id)).gcount() == 0)
+			return true;
+		if (in.gcount() != sizeof(id)
+				|| in.read(reinterpret_cast<char *>(&length),
+						sizeof(length)).gcount() != sizeof(length)) {
+			break;
+		}
+		text.resize(ntohl(length));
+		if (text.empty() == false
+				&& in.read(&text[0], text.size()).gcount()
+						!= streamsize(text.size())) {
+			break;
+		}
+		ids[text] = int64_t(be64toh(id));
+	}
+
+	cerr << path << " is cut off, starting a new cmdline cache" << endl;
+	return false;
+}
+
+// Written beside the cache and renamed over it, so a crash leaves the old
+// or the new cache but never half of one
+void Cmdlines::save(void) {
+	string temporary = path + ".tmp";
+	{
+		ofstream out(temporary.c_str(), ios::binary | ios::trunc);
+		out.write(cmdlines_magic, sizeof(cmdlines_magic));
+		for (unordered_map<string, int64_t>::iterator i = ids.begin();
+				i != ids.end(); ++i) {
+			uint64_t id = htobe64(i->second);
+			uint32_t length = htonl(i->first.size());
+			out.write(reinterpret_cast<const char *>(&id), sizeof(id));
+			out.write(reinterpret_cast<const char *>(&length), sizeof(length));
+			out.write(i->first.data(), i->first.size());
+		}
+		out.close();
+		if (out.fail()) {
+			perror(temporary.c_str());
+			return;
+		}
+	}
+	if (rename(temporary.c_str(), path.c_str()) == -1) {
+		perror(path.c_str());
+		return;
+	}
+	dirty = false;
+}
+
+// Insert the texts that are new and return the ids of all of them. A text
+// inserted by another collector whose transaction had not committed when
+// the statement started is skipped by the insert and not yet visible to
+// the select; it is found when the caller asks again.
+bool Cmdlines::lookup(Pgsql &db, const vector<string> &texts,
+		unordered_map<string, int64_t> &found) {
+	for (size_t first = 0; first < texts.size(); first += cmdlines_chunk) {
+		size_t last = min(texts.size(), first + cmdlines_chunk);
+		string query = "WITH v (hash, text) AS (VALUES ";
+		vector<string> values;
+		for (size_t i = first; i < last; ++i) {
+			if (i > first)
+				query += ", ";
+			query += "($" + to_string(values.size() + 1) + "::bigint, $"
+					+ to_string(values.size() + 2) + "::text)";
+			values.push_back(to_string(hash(texts[i])));
+			values.push_back(texts[i]);
+		}
+		query += "), ins AS (INSERT INTO cmdlines (hash, text)"
+				" SELECT hash, text FROM v"
+				" ON CONFLICT (hash, md5(text)) DO NOTHING RETURNING id, text)"
+				" SELECT id, text FROM ins UNION ALL"
+				" SELECT c.id, c.text FROM cmdlines c"
+				" JOIN v ON c.hash = v.hash AND c.text = v.text";
+
+		PGresult *res = db.exec(query, values);
+		if (res == NULL)
+			return false;
+		for (int i = 0; i < PQntuples(res); ++i) {
+			found[string(PQgetvalue(res, i, 1), PQgetlength(res, i, 1))] =
+					strtoll(PQgetvalue(res, i, 0), NULL, 10);
+		}
+		PQclear(res);
+	}
+	return true;
+}
+
+// The cmdline of a row, in a buffer that is reused so that looking it up
+// allocates nothing
+static const string &cmdline(const Delta::Row &row) {
+	static thread_local string text;
+	size_t length;
+	const char *data = row.table->text(PidSchema::cmdline, row.row, length);
+	text.assign(data, length);
+	return text;
+}
+
+// Fill out with the cmdline_id of each row. New command lines are
+// interned in statements of their own, outside of the set's transaction,
+// so an id in the cache always refers to a committed row.
+bool Cmdlines::resolve(Pgsql &db, const vector<Delta::Row> &rows,
+		vector<int64_t> &out) {
+	vector<string> missing;
+	{
+		lock_guard<mutex> guard(lock);
+		unordered_map<string, bool> seen;
+		for (vector<Delta::Row>::const_iterator r = rows.begin();
+				r != rows.end(); ++r) {
+			const string &text = cmdline(*r);
+			if (ids.count(text) == 0 && seen.insert(make_pair(text, true)).second)
+				missing.push_back(text);
+		}
+	}
+
+	unordered_map<string, int64_t> found;
+	if (missing.empty() == false) {
+		if (lookup(db, missing, found) == false)
+			return false;
+		if (found.size() < missing.size()) {
+			vector<string> again;
+			for (vector<string>::iterator i = missing.begin();
+					i != missing.end(); ++i) {
+				if (found.count(*i) == 0)
+					again.push_back(*i);
+			}
+			if (lookup(db, again, found) == false)
+				return false;
+		}
+	}
+
+	lock_guard<mutex> guard(lock);
+	if (found.empty() == false) {
+		if (ids.size() + found.size() > cmdlines_max)
+			ids.clear();
+		ids.insert(found.begin(), found.end());
+		dirty = true;
+	}
+
+	out.resize(rows.size());
+	for (size_t i = 0; i < rows.size(); ++i) {
+		const string &text = cmdline(rows[i]);
+		unordered_map<string, int64_t>::iterator id = found.find(text);
+		if (id == found.end()) {
+			id = ids.find(text);
+			if (id == ids.end()) {
+				cerr << "No cmdline_id for " << text << endl;
+				return false;
+			}
+		}
+		out[i] = id->second;
+	}
+
+	if (dirty)
+		save();
+	return true;
+}
+
+// Forget every id, for when a set that used them was refused: the
+// database may have been replaced under the cache
+void Cmdlines::clear(void) {
+	lock_guard<mutex> guard(lock);
+	if (ids.empty() == false) {
+		ids.clear();
+		dirty = true;
+	}
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef CMDLINES_H_
+#define CMDLINES_H_
+
+extern "C" {
+#include <stdint.h>
+}
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+#include "Delta.h"
+
+using namespace std;
+
+class Pgsql;
+
+// Interns command lines in the cmdlines table (--cmdlines), so pids rows
+// carry a cmdline_id instead of the text. The ids seen so far are kept
+// in memory and in a small cache file that survives restarts; only
+// command lines missing from it are looked up, or inserted, in one
+// statement per set. The hash column is FNV-1a of the text and the table
+// is unique on (hash, md5(text)), so equal hashes of different texts still
+// get ids of their own.
+class Cmdlines {
+private:
+	static string path;
+	static unordered_map<string, int64_t> ids;
+	static mutex lock;
+	static bool dirty;
+
+	static bool lookup(Pgsql &db, const vector<string> &texts,
+			unordered_map<string, int64_t> &found);
+	static bool load(void);
+	static void save(void);
+
+public:
+	static int64_t hash(const string &text);
+	static bool open(const string &path);
+	static bool enabled(void);
+	static bool resolve(Pgsql &db, const vector<Delta::Row> &rows,
+			vector<int64_t> &out);
+	static void clear(void);
+};
+
+#endif /* CMDLINES_H_ */
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "Delta.h"
+
+Delta::Delta(unsigned keyframe_interval) :
+		keyframe_interval(keyframe_interval), since_keyframe(0),
+		have_previous(false), keyframe(true) {
+}
+
+Delta::~Delta() {
+}
+
+// Fill rows with the differences between the last stored snapshot and
+// current. Returns true instead when this set must be a keyframe, in which
+// case rows is left empty and the whole snapshot should be stored.
+// Both snapshots are in PID order, so this is a single merge pass.
+bool Delta::compute(const PidTable &current, vector<Row> &rows) {
+	rows.clear();
+
+	keyframe = have_previous == false
+			|| since_keyframe + 1 >= keyframe_interval;
+	if (keyframe) {
+		return true;
+	}
+
+	size_t old = 0, now = 0;
+	Row exited = { EXITED, &previous, 0 };
+	Row found = { NEW, &current, 0 };
+	while (old < previous.size() || now < current.size()) {
+		if (now == current.size()
+				|| (old < previous.size()
+						&& previous.pid(old) < current.pid(now))) {
+			exited.row = old++;
+			rows.push_back(exited);
+		} else if (old == previous.size()
+				|| current.pid(now) < previous.pid(old)) {
+			found.change = NEW;
+			found.row = now++;
+			rows.push_back(found);
+		} else if (previous.starttime(old) != current.starttime(now)) {
+			// PID was reused, report the old process gone first
+			exited.row = old++;
+			rows.push_back(exited);
+			found.change = NEW;
+			found.row = now++;
+			rows.push_back(found);
+		} else {
+			if (current.differs(now, previous, old)) {
+				found.change = CHANGED;
+				found.row = now;
+				rows.push_back(found);
+			}
+			++old;
+			++now;
+		}
+	}
+
+	return false;
+}
+
+// Call once the set built from current has been stored
+void Delta::advance(const PidTable &current) {
+	if (keyframe) {
+		since_keyframe = 0;
+	} else {
+		since_keyframe++;
+	}
+	previous = current;
+	have_previous = true;
+}
+
+// Call when a set could not be stored; the next one is a keyframe
+void Delta::reset(void) {
+	previous.clear();
+	have_previous = false;
+	since_keyframe = 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef DELTA_H_
+#define DELTA_H_
+
+extern "C" {
+#include <stdint.h>
+}
+
+#include <vector>
+#include "PidTable.h"
+
+using namespace std;
+
+// Turns consecutive snapshots into keyframes and deltas. A process is
+// identified by (pid, starttime) so a recycled PID shows up as an exit and
+// a new process. Every keyframe_interval sets, and after any set that
+// could not be stored, a full keyframe is produced instead of a delta.
+class Delta {
+public:
+	enum Change {
+		NEW = 'N', CHANGED = 'C', EXITED = 'X'
+	};
+
+	// A row of a snapshot, or of the previous one for an exited process
+	struct Row {
+		char change;
+		const PidTable *table;
+		size_t row;
+	};
+
+private:
+	PidTable previous;
+	unsigned keyframe_interval;
+	unsigned since_keyframe;
+	bool have_previous;
+	bool keyframe;
+
+public:
+	Delta(unsigned keyframe_interval);
+	virtual ~Delta();
+	bool compute(const PidTable &current, vector<Row> &rows);
+	void advance(const PidTable &current);
+	void reset(void);
+};
+
+#endif /* DELTA_H_ */
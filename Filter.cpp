@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <string.h>
+}
+
+#include <algorithm>
+#include <iostream>
+#include "Filter.h"
+#include "PidSchema.h"
+#include "Metrics.h"
+
+// Columns the "other" row adds up. The rest of it is zero; rates of -1,
+// processes without a previous sample, are left out of the sums.
+static const char *summed[] = { "minflt", "cminflt", "majflt", "cmajflt",
+		"utime", "stime", "cutime", "num_threads", "rss", "cpu_delay",
+		"blkio_delay", "swapin_delay", "nvcsw", "nivcsw", "hiwater_rss",
+		"read_bytes", "write_bytes", "utime_rate", "stime_rate",
+		"minflt_rate", "majflt_rate" };
+
+static bool isSummed(const char *name) {
+	for (size_t i = 0; i < sizeof(summed) / sizeof(summed[0]); ++i) {
+		if (strcmp(summed[i], name) == 0)
+			return true;
+	}
+	return false;
+}
+
+// Orders candidate rows by weight, heaviest first
+class Heavier {
+private:
+	const vector<int64_t> &weights;
+public:
+	Heavier(const vector<int64_t> &weights) :
+			weights(weights) {
+	}
+	bool operator()(size_t a, size_t b) const {
+		return weights[a] > weights[b];
+	}
+};
+
+Filter::Filter() :
+		kthreads(true), top(0), key(CPU), other(false), have_patterns(false) {
+}
+
+Filter::~Filter() {
+	if (have_patterns)
+		regfree(&patterns);
+}
+
+void Filter::excludeKthreads(void) {
+	kthreads = false;
+}
+
+void Filter::keepTop(size_t n, Key key) {
+	top = n;
+	this->key = key;
+}
+
+// POSIX extended expressions, matched anywhere in cmdline or comm. False,
+// with the reason on cerr, if they do not compile.
+bool Filter::keepMatching(const vector<string> &expressions) {
+	if (expressions.empty())
+		return true;
+
+	string all;
+	for (size_t i = 0; i < expressions.size(); ++i) {
+		if (i > 0)
+			all += "|";
+		all += "(" + expressions[i] + ")";
+	}
+	if (have_patterns)
+		regfree(&patterns);
+	int rc = regcomp(&patterns, all.c_str(), REG_EXTENDED | REG_NOSUB);
+	have_patterns = rc == 0;
+	if (rc != 0) {
+		char error[256];
+		regerror(rc, &patterns, error, sizeof(error));
+		cerr << "Bad --keep pattern: " << error << endl;
+		return false;
+	}
+	return true;
+}
+
+void Filter::rollUp(void) {
+	other = true;
+}
+
+bool Filter::active(void) const {
+	return kthreads == false || top > 0 || have_patterns;
+}
+
+bool Filter::matches(const PidTable &pids, size_t column, size_t row) {
+	size_t length;
+	const char *data = pids.text(column, row, length);
+	text.assign(data, length);
+	return regexec(&patterns, text.c_str(), 0, NULL, 0) == 0;
+}
+
+// Without rates, in a one-shot run or for a new process, CPU and faults
+// fall back to the totals since the process started
+int64_t Filter::weight(const PidTable &pids, size_t row) const {
+	switch (key) {
+	case RSS:
+		return pids.number(PidSchema::rss, row);
+	case FAULTS: {
+		int64_t minflt = pids.number(PidSchema::minflt_rate, row);
+		int64_t majflt = pids.number(PidSchema::majflt_rate, row);
+		if (minflt < 0 || majflt < 0)
+			return pids.number(PidSchema::minflt, row)
+					+ pids.number(PidSchema::majflt, row);
+		return minflt + majflt;
+	}
+	default: {
+		int64_t utime = pids.number(PidSchema::utime_rate, row);
+		int64_t stime = pids.number(PidSchema::stime_rate, row);
+		if (utime < 0 || stime < 0)
+			return pids.number(PidSchema::utime, row)
+					+ pids.number(PidSchema::stime, row);
+		return utime + stime;
+	}
+	}
+}
+
+// The top processes are picked with nth_element, linear on average,
+// rather than by sorting all of them
+void Filter::apply(PidTable &pids) {
+	if (active() == false)
+		return;
+
+	size_t rows = pids.size();
+	keep.assign(rows, 0);
+	candidates.clear();
+	for (size_t row = 0; row < rows; ++row) {
+		size_t length;
+		pids.text(PidSchema::cmdline, row, length);
+		if (kthreads == false && length == 0)
+			continue;
+		if (top == 0 && have_patterns == false) {
+			keep[row] = 1;
+		} else if (have_patterns && (matches(pids, PidSchema::cmdline, row)
+				|| matches(pids, PidSchema::comm, row))) {
+			keep[row] = 1;
+		} else if (top > 0) {
+			candidates.push_back(row);
+		}
+	}
+
+	if (candidates.size() > top) {
+		weights.resize(rows);
+		for (size_t i = 0; i < candidates.size(); ++i)
+			weights[candidates[i]] = weight(pids, candidates[i]);
+		nth_element(candidates.begin(), candidates.begin() + top,
+				candidates.end(), Heavier(weights));
+		candidates.resize(top);
+	}
+	for (size_t i = 0; i < candidates.size(); ++i)
+		keep[candidates[i]] = 1;
+
+	kept.clear();
+	size_t dropped = rows - count(keep.begin(), keep.end(), 1);
+	if (other && dropped > 0) {
+		sums.assign(PidSchema::count, 0);
+		for (size_t i = 0; i < PidSchema::count; ++i) {
+			if (isSummed(PidSchema::columns[i].name) == false)
+				continue;
+			for (size_t row = 0; row < rows; ++row) {
+				int64_t value = pids.number(i, row);
+				if (keep[row] == 0 && value > 0)
+					sums[i] += value;
+			}
+		}
+		// PID 0 sorts first, so the table stays in PID order
+		for (size_t i = 0; i < PidSchema::count; ++i) {
+			if (PidSchema::columns[i].type == TEXTOID) {
+				kept.addText(i, "other", 5);
+			} else if (i == PidSchema::state) {
+				kept.addNumber(i, '-');
+			} else {
+				kept.addNumber(i, sums[i]);
+			}
+		}
+		kept.endRow();
+	}
+	for (size_t row = 0; row < rows; ++row) {
+		if (keep[row])
+			kept.append(pids, row);
+	}
+
+	Metrics::count(Metrics::FILTERED, dropped);
+	pids.swap(kept);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+extern "C" {
+#include <stdint.h>
+#include <stddef.h>
+#include <regex.h>
+}
+
+#include <string>
+#include <vector>
+#include "PidTable.h"
+
+using namespace std;
+
+// Narrows a snapshot to the processes that matter before it is queued.
+// Kernel threads can be left out altogether. Of the rest, a process is
+// kept when its cmdline or comm matches one of the patterns, or when it is
+// among the top processes by CPU, RSS or page faults; with neither set
+// every process is kept. What is left out can be summed into one row per
+// snapshot, PID 0 with comm "other". The table stays in PID order.
+class Filter {
+public:
+	enum Key {
+		CPU, RSS, FAULTS
+	};
+
+private:
+	bool kthreads;
+	size_t top;
+	Key key;
+	bool other;
+	// All patterns as one alternation, compiled once
+	regex_t patterns;
+	bool have_patterns;
+
+	PidTable kept;
+	vector<char> keep;
+	vector<size_t> candidates;
+	vector<int64_t> weights;
+	vector<int64_t> sums;
+	string text;
+
+	bool matches(const PidTable &pids, size_t column, size_t row);
+	int64_t weight(const PidTable &pids, size_t row) const;
+
+public:
+	Filter();
+	virtual ~Filter();
+	void excludeKthreads(void);
+	void keepTop(size_t n, Key key);
+	bool keepMatching(const vector<string> &expressions);
+	void rollUp(void);
+	bool active(void) const;
+	void apply(PidTable &pids);
+};
+
+#endif /* FILTER_H_ */
@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+}
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include "Metrics.h"
+#include "Pgsql.h"
+#include "Relay.h"
+
+Histogram Metrics::phases[PHASES];
+atomic<uint64_t> Metrics::counters[COUNTERS];
+vector<uint64_t> Metrics::stored_phases[PHASES];
+uint64_t Metrics::stored_counters[COUNTERS];
+atomic<uint64_t> Metrics::gauges[GAUGES];
+
+const char *Metrics::phase_names[PHASES] = { "enumerate", "parse", "prepare",
+		"send", "commit", "cycle" };
+const char *Metrics::counter_names[COUNTERS] = { "pids_vanished",
+		"flush_waits", "db_errors", "queue_dropped", "queue_coalesced",
+		"pids_filtered" };
+const char *Metrics::gauge_names[GAUGES] = { "queue_depth",
+		"upload_window_ms" };
+
+Histogram::Histogram() :
+		total(0), sum(0) {
+	for (unsigned i = 0; i < buckets; ++i) {
+		counts[i] = 0;
+	}
+}
+
+unsigned Histogram::bucket(uint64_t value) {
+	if (value < (1u << sub_bits))
+		return value;
+	unsigned exponent = 63 - __builtin_clzll(value);
+	unsigned shift = exponent - sub_bits;
+	return ((shift + 1) << sub_bits) + (value >> shift) - (1u << sub_bits);
+}
+
+// The largest value that lands in bucket
+uint64_t Histogram::highest(unsigned bucket) {
+	if (bucket < (1u << sub_bits))
+		return bucket;
+	unsigned shift = (bucket >> sub_bits) - 1;
+	uint64_t sub = bucket & ((1u << sub_bits) - 1);
+	return (((1u << sub_bits) + sub) << shift) + ((uint64_t(1) << shift) - 1);
+}
+
+void Histogram::record(uint64_t value) {
+	counts[bucket(value)].fetch_add(1, memory_order_relaxed);
+	total.fetch_add(1, memory_order_relaxed);
+	sum.fetch_add(value, memory_order_relaxed);
+}
+
+void Histogram::read(vector<uint64_t> &out) const {
+	out.resize(buckets);
+	for (unsigned i = 0; i < buckets; ++i) {
+		out[i] = counts[i].load(memory_order_relaxed);
+	}
+}
+
+uint64_t Histogram::getCount(void) const {
+	return total.load(memory_order_relaxed);
+}
+
+uint64_t Histogram::getSum(void) const {
+	return sum.load(memory_order_relaxed);
+}
+
+// The value below which a fraction q of the counted values lie
+uint64_t Histogram::quantile(const vector<uint64_t> &counts, double q) {
+	uint64_t count = 0;
+	for (size_t i = 0; i < counts.size(); ++i) {
+		count += counts[i];
+	}
+	if (count == 0)
+		return 0;
+
+	uint64_t rank = uint64_t(q * count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	uint64_t seen = 0;
+	for (size_t i = 0; i < counts.size(); ++i) {
+		seen += counts[i];
+		if (seen >= rank)
+			return highest(i);
+	}
+	return highest(counts.size() - 1);
+}
+
+uint64_t Histogram::maximum(const vector<uint64_t> &counts) {
+	for (size_t i = counts.size(); i > 0; --i) {
+		if (counts[i - 1] > 0)
+			return highest(i - 1);
+	}
+	return 0;
+}
+
+Metrics::Timer::Timer(Phase phase) :
+		phase(phase), start(Metrics::now()) {
+}
+
+Metrics::Timer::~Timer() {
+	Metrics::record(phase, Metrics::now() - start);
+}
+
+uint64_t Metrics::now(void) {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void Metrics::record(Phase phase, uint64_t ns) {
+	phases[phase].record(ns);
+}
+
+void Metrics::count(Counter counter, uint64_t n) {
+	counters[counter].fetch_add(n, memory_order_relaxed);
+}
+
+void Metrics::set(Gauge gauge, uint64_t value) {
+	gauges[gauge].store(value, memory_order_relaxed);
+}
+
+// Prometheus text format: each phase as a summary in seconds
+void Metrics::write(ostream &out) {
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 1 };
+
+	out << "# HELP pid2pgsql_phase_seconds Time spent in each phase of a "
+			"snapshot.\n# TYPE pid2pgsql_phase_seconds summary\n";
+	vector<uint64_t> counts;
+	for (unsigned p = 0; p < PHASES; ++p) {
+		phases[p].read(counts);
+		for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); ++q) {
+			out << "pid2pgsql_phase_seconds{phase=\"" << phase_names[p]
+					<< "\",quantile=\"" << quantiles[q] << "\"} "
+					<< Histogram::quantile(counts, quantiles[q]) / 1e9 << "\n";
+		}
+		out << "pid2pgsql_phase_seconds_sum{phase=\"" << phase_names[p]
+				<< "\"} " << phases[p].getSum() / 1e9 << "\n";
+		out << "pid2pgsql_phase_seconds_count{phase=\"" << phase_names[p]
+				<< "\"} " << phases[p].getCount() << "\n";
+	}
+
+	for (unsigned c = 0; c < COUNTERS; ++c) {
+		out << "# TYPE pid2pgsql_" << counter_names[c] << "_total counter\n";
+		out << "pid2pgsql_" << counter_names[c] << "_total "
+				<< counters[c].load(memory_order_relaxed) << "\n";
+	}
+
+	for (unsigned g = 0; g < GAUGES; ++g) {
+		out << "# TYPE pid2pgsql_" << gauge_names[g] << " gauge\n";
+		out << "pid2pgsql_" << gauge_names[g] << " "
+				<< gauges[g].load(memory_order_relaxed) << "\n";
+	}
+}
+
+// Written beside path and renamed over it, so a reader such as the node
+// exporter's textfile collector never sees half a file
+bool Metrics::writeFile(const string &path) {
+	string temporary = path + ".tmp";
+	{
+		ofstream out(temporary.c_str());
+		write(out);
+		out.close();
+		if (out.fail()) {
+			perror(temporary.c_str());
+			return false;
+		}
+	}
+	if (rename(temporary.c_str(), path.c_str()) == -1) {
+		perror(path.c_str());
+		return false;
+	}
+	return true;
+}
+
+// One collector_stats row for the time since the last stored row, with
+// the count, median, 99th percentile and maximum of each phase in
+// nanoseconds, the counters' increments and the gauges' current values
+bool Metrics::store(Pgsql &db, const string &nodename, const Clock &time) {
+	vector<uint64_t> current[PHASES];
+	uint64_t current_counters[COUNTERS];
+	for (unsigned p = 0; p < PHASES; ++p) {
+		phases[p].read(current[p]);
+	}
+	for (unsigned c = 0; c < COUNTERS; ++c) {
+		current_counters[c] = counters[c].load(memory_order_relaxed);
+	}
+
+	db.begin();
+	Prepare insert = db.createPrepare("collector_stats_insert");
+	insert.setTableName("collector_stats");
+	insert.addCol("nodename", nodename);
+	insert.addCol("stat_time", time);
+	vector<uint64_t> interval(Histogram::buckets);
+	for (unsigned p = 0; p < PHASES; ++p) {
+		uint64_t count = 0;
+		for (unsigned i = 0; i < Histogram::buckets; ++i) {
+			uint64_t before = stored_phases[p].empty() ? 0 : stored_phases[p][i];
+			interval[i] = current[p][i] - before;
+			count += interval[i];
+		}
+		string name = phase_names[p];
+		insert.addCol(name + "_count", int64_t(count));
+		insert.addCol(name + "_p50",
+				int64_t(Histogram::quantile(interval, 0.5)));
+		insert.addCol(name + "_p99",
+				int64_t(Histogram::quantile(interval, 0.99)));
+		insert.addCol(name + "_max", int64_t(Histogram::maximum(interval)));
+	}
+	for (unsigned c = 0; c < COUNTERS; ++c) {
+		insert.addCol(counter_names[c],
+				int64_t(current_counters[c] - stored_counters[c]));
+	}
+	for (unsigned g = 0; g < GAUGES; ++g) {
+		insert.addCol(gauge_names[g],
+				int64_t(gauges[g].load(memory_order_relaxed)));
+	}
+	insert.exec();
+	insert.getResult();
+	if (db.commit() == false) {
+		return false;
+	}
+
+	// A row that was not stored is covered by the next one
+	for (unsigned p = 0; p < PHASES; ++p) {
+		stored_phases[p].swap(current[p]);
+	}
+	for (unsigned c = 0; c < COUNTERS; ++c) {
+		stored_counters[c] = current_counters[c];
+	}
+	return true;
+}
+
+MetricsServer::MetricsServer() :
+		listener(-1), wakeup(-1) {
+}
+
+MetricsServer::~MetricsServer() {
+	if (worker.joinable()) {
+		uint64_t one = 1;
+		if (::write(wakeup, &one, sizeof(one)) == -1)
+			perror("eventfd");
+		worker.join();
+	}
+	if (listener != -1)
+		close(listener);
+	if (wakeup != -1)
+		close(wakeup);
+}
+
+bool MetricsServer::listen(const string &address) {
+	wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup == -1) {
+		perror("eventfd");
+		return false;
+	}
+	listener = RelayClient::open(address, true);
+	if (listener == -1)
+		return false;
+
+	worker = thread(&MetricsServer::run, this);
+	return true;
+}
+
+void MetricsServer::run(void) {
+	for (;;) {
+		pollfd fds[2];
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+		fds[1].fd = wakeup;
+		fds[1].events = POLLIN;
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return;
+		}
+		if (fds[1].revents != 0)
+			return;
+
+		int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1)
+			continue;
+		answer(fd);
+		close(fd);
+	}
+}
+
+// Whatever was asked, the answer is the metrics. A client gets a second
+// to send its request, so a stuck one cannot hold up the others for long.
+void MetricsServer::answer(int fd) {
+	timeval timeout = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	string request;
+	char buffer[1024];
+	while (request.find("\r\n\r\n") == string::npos && request.size() < 8192) {
+		ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+		if (n <= 0)
+			return;
+		request.append(buffer, n);
+	}
+
+	stringstream body;
+	Metrics::write(body);
+	stringstream response;
+	response << "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: " << body.str().size() << "\r\n"
+			"Connection: close\r\n\r\n" << body.str();
+
+	string out = response.str();
+	for (size_t sent = 0; sent < out.size();) {
+		ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			return;
+		sent += n;
+	}
+}
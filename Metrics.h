@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+extern "C" {
+#include <stdint.h>
+}
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <ostream>
+
+using namespace std;
+
+class Pgsql;
+class Clock;
+
+// Counts of values in log-linear buckets, HDR style: values below 32 have
+// a bucket each, above that every power of two is split into 32 buckets,
+// so a quantile is within about 3% of the true value. Recording is a few
+// relaxed atomic adds and safe from any thread.
+class Histogram {
+public:
+	static const unsigned sub_bits = 5;
+	static const unsigned buckets = (64 - sub_bits + 1) << sub_bits;
+
+private:
+	atomic<uint64_t> counts[buckets];
+	atomic<uint64_t> total;
+	atomic<uint64_t> sum;
+
+	static unsigned bucket(uint64_t value);
+	static uint64_t highest(unsigned bucket);
+
+public:
+	Histogram();
+	void record(uint64_t value);
+	void read(vector<uint64_t> &out) const;
+	uint64_t getCount(void) const;
+	uint64_t getSum(void) const;
+	static uint64_t quantile(const vector<uint64_t> &counts, double q);
+	static uint64_t maximum(const vector<uint64_t> &counts);
+};
+
+// The collector's own timings, in nanoseconds of the monotonic clock, and
+// event counters. They are kept from the start of the process and handed
+// out as a Prometheus text file (--metrics-file), over HTTP
+// (--metrics-addr) or as collector_stats rows (--collector-stats).
+class Metrics {
+public:
+	enum Phase {
+		ENUMERATE, PARSE, PREPARE, SEND, COMMIT, CYCLE, PHASES
+	};
+
+	enum Counter {
+		VANISHED, FLUSH_WAITS, DB_ERRORS, QUEUE_DROPPED, QUEUE_COALESCED,
+		FILTERED, COUNTERS
+	};
+
+	// Values that go up and down, reported as they are now
+	enum Gauge {
+		QUEUE_DEPTH, UPLOAD_WINDOW, GAUGES
+	};
+
+	// Records the time from its construction to its destruction
+	class Timer {
+	private:
+		Phase phase;
+		uint64_t start;
+	public:
+		Timer(Phase phase);
+		~Timer();
+	};
+
+private:
+	static Histogram phases[PHASES];
+	static atomic<uint64_t> counters[COUNTERS];
+	static const char *phase_names[PHASES];
+	static const char *counter_names[COUNTERS];
+	static atomic<uint64_t> gauges[GAUGES];
+	static const char *gauge_names[GAUGES];
+
+	// What the last stored collector_stats row covered
+	static vector<uint64_t> stored_phases[PHASES];
+	static uint64_t stored_counters[COUNTERS];
+
+public:
+	static uint64_t now(void);
+	static void record(Phase phase, uint64_t ns);
+	static void count(Counter counter, uint64_t n = 1);
+	static void set(Gauge gauge, uint64_t value);
+	static void write(ostream &out);
+	static bool writeFile(const string &path);
+	static bool store(Pgsql &db, const string &nodename, const Clock &time);
+};
+
+// Answers every HTTP request on its socket with the metrics, from a thread
+// of its own
+class MetricsServer {
+private:
+	int listener;
+	int wakeup;
+	thread worker;
+
+	void run(void);
+	void answer(int fd);
+
+public:
+	MetricsServer();
+	virtual ~MetricsServer();
+	bool listen(const string &address);
+};
+
+#endif /* METRICS_H_ */
@@ -21,45 +21,197 @@ extern "C" {
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <endian.h>
+#include <arpa/inet.h>
 }
 
 #include <sstream>
 #include <iostream>
+#include <limits>
+#include <algorithm>
 #include "Pgsql.h"
 #include "Clock.h"
+#include "Metrics.h"
 
 using namespace std;
 
-PGconn *Pgsql::conn = NULL;
-map<string, PGresult *> Prepare::existing_prepares;
+map<PGconn *, set<string> > Prepare::existing_prepares;
+mutex Prepare::prepares_lock;
+map<string, map<string, Oid> > Copy::column_types;
+mutex Copy::column_types_lock;
 
-Pgsql::Pgsql(const char dbhost[], const char dbname[], const char dbuser[],
-		const char dbpass[], bool debug_value) {
-	debug = debug_value;
+// Size at which buffered COPY data is handed to libpq
+static const size_t copy_chunk = 65536;
 
-	stringstream ss;
-	ss << "host=" << dbhost << " dbname=" << dbname << " user=" << dbuser
-			<< " password=" << dbpass << " sslmode=verify-full"
-			<< " sslrootcert=server.crt";
+static const char copy_signature[] = "PGCOPY\n\377\r\n";
+
+static void appendInt16(string &buffer, int16_t value) {
+	uint16_t n = htons(value);
+	buffer.append(reinterpret_cast<const char *>(&n), sizeof(n));
+}
+
+static void appendInt32(string &buffer, int32_t value) {
+	uint32_t n = htonl(value);
+	buffer.append(reinterpret_cast<const char *>(&n), sizeof(n));
+}
+
+static void appendInt64(string &buffer, int64_t value) {
+	uint64_t n = htobe64(value);
+	buffer.append(reinterpret_cast<const char *>(&n), sizeof(n));
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+static bool flushPipeline(PGconn *conn) {
+	int rc;
+	while ((rc = PQflush(conn)) == 1) {
+		Metrics::count(Metrics::FLUSH_WAITS);
+		pollfd pfd;
+		pfd.fd = PQsocket(conn);
+		pfd.events = POLLIN | POLLOUT;
+		pfd.revents = 0;
+		poll(&pfd, 1, 1000);
+		if ((pfd.revents & POLLIN) && PQconsumeInput(conn) == 0)
+			break;
+	}
 
-	if (conn == NULL || PQstatus(conn) != CONNECTION_OK) {
-		conn = PQconnectdb(ss.str().c_str());
-		if (PQstatus(conn) != CONNECTION_OK) {
-			stringstream errormsg;
-			cerr << PQerrorMessage(conn) << endl;
-			throw new Error();
+	if (rc != 0) {
+		cerr << "Error flushing pipeline: " << PQerrorMessage(conn);
+		return false;
+	}
+	return true;
+}
+
+// Mark a sync point and collect every result queued before it. Returns
+// false if any statement failed. The last result that returned rows is
+// handed back through rows when asked for.
+static bool syncPipeline(PGconn *conn, PGresult **rows = NULL) {
+	if (PQpipelineSync(conn) == 0) {
+		cerr << "Error sending pipeline sync: " << PQerrorMessage(conn);
+		return false;
+	}
+
+	bool ok = flushPipeline(conn);
+	for (;;) {
+		PGresult *res = PQgetResult(conn);
+		if (res == NULL) {
+			// End of one statement's results
+			if (PQstatus(conn) == CONNECTION_BAD)
+				return false;
+			continue;
 		}
 
-		if (PQsetnonblocking(conn, 1) == -1) {
-			cerr << "Unable to set pgsql connection non-blocking\n"
-					<< PQerrorMessage(conn) << endl;
+		ExecStatusType status = PQresultStatus(res);
+		if (status == PGRES_PIPELINE_SYNC) {
+			PQclear(res);
+			break;
 		}
+
+		if (status == PGRES_FATAL_ERROR) {
+			cerr << "Error occurred in pipeline: "
+					<< PQresultErrorMessage(res) << endl;
+			ok = false;
+		} else if (status == PGRES_PIPELINE_ABORTED) {
+			ok = false;
+		} else if (status == PGRES_TUPLES_OK && rows != NULL) {
+			if (*rows != NULL)
+				PQclear(*rows);
+			*rows = res;
+			continue;
+		}
+		PQclear(res);
+	}
+
+	return ok;
+}
+#endif
+
+static size_t formatDecimal(char *out, int64_t value) {
+	char digits[24];
+	size_t len = 0;
+	uint64_t magnitude = value < 0 ? 0 - uint64_t(value) : uint64_t(value);
+
+	do {
+		digits[len++] = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude > 0);
+
+	size_t pos = 0;
+	if (value < 0)
+		out[pos++] = '-';
+	while (len > 0)
+		out[pos++] = digits[--len];
+
+	return pos;
+}
+
+Pgsql::Pgsql(const char dbhost[], const char dbname[], const char dbuser[],
+		const char dbpass[], bool debug_value) :
+		conn(NULL), set_id_block(1) {
+	debug = debug_value;
+#ifdef LIBPQ_HAS_PIPELINING
+	pipeline = true;
+#else
+	pipeline = false;
+#endif
+
+	// Leave out empty settings so libpq falls back to its defaults for them
+	stringstream ss;
+	if (dbhost[0] != '\0')
+		ss << "host=" << dbhost << " ";
+	if (dbname[0] != '\0')
+		ss << "dbname=" << dbname << " ";
+	if (dbuser[0] != '\0')
+		ss << "user=" << dbuser << " ";
+	if (dbpass[0] != '\0')
+		ss << "password=" << dbpass << " ";
+	ss << "sslmode=verify-full" << " sslrootcert=server.crt";
+
+	conn = PQconnectdb(ss.str().c_str());
+	if (PQstatus(conn) != CONNECTION_OK) {
+		cerr << PQerrorMessage(conn) << endl;
+		PQfinish(conn);
+		conn = NULL;
+		Metrics::count(Metrics::DB_ERRORS);
+		throw new Error();
 	}
 
+	if (PQsetnonblocking(conn, 1) == -1) {
+		cerr << "Unable to set pgsql connection non-blocking\n"
+				<< PQerrorMessage(conn) << endl;
+	}
 }
 
 Pgsql::~Pgsql() {
+	Prepare::clearPrepares(conn);
 	PQfinish(conn);
+	conn = NULL;
+}
+
+bool Pgsql::connected(void) {
+	return conn != NULL && PQstatus(conn) == CONNECTION_OK;
+}
+
+// Re-establish a dropped connection. Prepared statements do not survive
+// the new session, so they are forgotten and get prepared again on use,
+// and reserved set_ids are given up as in rollback().
+bool Pgsql::reconnect(void) {
+	Prepare::clearPrepares(conn);
+	set_ids.clear();
+	PQreset(conn);
+	if (PQstatus(conn) != CONNECTION_OK) {
+		cerr << PQerrorMessage(conn) << endl;
+		Metrics::count(Metrics::DB_ERRORS);
+		return false;
+	}
+
+	if (PQsetnonblocking(conn, 1) == -1) {
+		cerr << "Unable to set pgsql connection non-blocking\n"
+				<< PQerrorMessage(conn) << endl;
+	}
+
+	return true;
 }
 void Pgsql::enableDebug(void) {
 	debug = true;
@@ -69,7 +221,43 @@ void Pgsql::disableDebug(void) {
 	debug = false;
 }
 
+bool Pgsql::getDebug(void) {
+	return debug;
+}
+
+// Pipeline mode needs libpq 14 or later at build time; any server that
+// speaks protocol 3 handles it.
+void Pgsql::enablePipeline(void) {
+#ifdef LIBPQ_HAS_PIPELINING
+	pipeline = true;
+#endif
+}
+
+void Pgsql::disablePipeline(void) {
+	pipeline = false;
+}
+
+bool Pgsql::getPipeline(void) {
+	return pipeline;
+}
+
+void Pgsql::enqueue(const Prepare &p) {
+	execqueue.push(p);
+}
+
 void Pgsql::processqueue(void) {
+#ifdef LIBPQ_HAS_PIPELINING
+	// Everything queued goes out back to back; results are checked at the
+	// next sync point
+	if (PQpipelineStatus(conn) != PQ_PIPELINE_OFF) {
+		while (execqueue.size() > 0) {
+			execqueue.front().exec();
+			execqueue.pop();
+		}
+		return;
+	}
+#endif
+
 	PQconsumeInput(conn);
 
 	if (PQisBusy(conn) == false) {
@@ -95,40 +283,98 @@ void Pgsql::processqueue(void) {
 	}
 }
 
-uint64_t Pgsql::lastval(void) {
-	PGresult *res = PQexec(conn, "SELECT lastval()");
-	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		cerr << "Error occurred: " << PQresultErrorMessage(res) << endl;
+// Largest number of set_ids reserved at once
+static const size_t set_id_block_max = 64;
+
+// Hand out a set_id for a new set. Ids are taken from the pid_sets
+// sequence ahead of use, a block at a time outside of any transaction, so
+// the set's pid_sets row and its processes can be sent without waiting
+// for the server to pick one. Sequence values are never given out twice,
+// so ids reserved by different collectors do not collide. The block
+// doubles up to set_id_block_max, leaving a short-lived collector at most
+// a few unused ids. False if no id could be reserved.
+bool Pgsql::nextSetId(uint64_t &id) {
+	if (set_ids.empty()) {
+		vector<string> values(1, to_string(set_id_block));
+		PGresult *res = exec("SELECT nextval(pg_get_serial_sequence('pid_sets',"
+				" 'set_id')) FROM generate_series(1, $1)", values);
+		if (res == NULL)
+			return false;
+
+		for (int i = PQntuples(res) - 1; i >= 0; --i) {
+			char *end;
+			uint64_t value = strtoull(PQgetvalue(res, i, 0), &end, 10);
+			if (value > 0 && *end == '\0')
+				set_ids.push_back(value);
+		}
 		PQclear(res);
-		return EXIT_FAILURE;
+		if (set_ids.empty()) {
+			cerr << "Error: no set_id could be reserved" << endl;
+			return false;
+		}
+		set_id_block = min(set_id_block * 2, set_id_block_max);
 	}
 
-	if (PQntuples(res) < 1) {
-		cerr << "Error: PQntuples(res) < 1" << endl;
-		PQclear(res);
-		return EXIT_FAILURE;
+	// Kept in reverse, the lowest id is at the back
+	id = set_ids.back();
+	set_ids.pop_back();
+	return true;
+}
+
+// value as a quoted SQL literal, for statements that cannot take
+// parameters
+string Pgsql::literal(const string &value) {
+	char *quoted = PQescapeLiteral(conn, value.data(), value.size());
+	if (quoted == NULL) {
+		cerr << "Error occurred: " << PQerrorMessage(conn);
+		return "NULL";
 	}
+	string result(quoted);
+	PQfreemem(quoted);
+	return result;
+}
 
-	char *buffer = PQgetvalue(res, 0, 0);
-	if (buffer == NULL || PQgetlength(res, 0, 0) < 1) {
-		cerr
-				<< "Error occurred getting set_id from pid_sets table. Buffer == NULL or PQgetlength(res, 0, 0) < 1"
-				<< endl;
+// Run a statement with text parameters outside of a pipeline and wait for
+// it. The result is the caller's to PQclear, NULL if the statement failed.
+PGresult *Pgsql::exec(const string &query, const vector<string> &values) {
+	vector<const char *> paramValues(values.size());
+	for (size_t i = 0; i < values.size(); ++i)
+		paramValues[i] = values[i].c_str();
+
+	PGresult *res = PQexecParams(conn, query.c_str(), values.size(), NULL,
+			paramValues.empty() ? NULL : &paramValues[0], NULL, NULL, 0);
+	ExecStatusType status = PQresultStatus(res);
+	if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK) {
+		cerr << "Error occurred: " << PQresultErrorMessage(res) << endl;
 		PQclear(res);
-		return 0;
+		return NULL;
 	}
 
-	uint64_t value = atoi(buffer);
-	PQclear(res);
-
-	return value;
+	return res;
 }
 
 Prepare Pgsql::createPrepare(string prepareID) {
-return Prepare(Pgsql::conn, prepareID, debug);
+	return Prepare(conn, prepareID, debug);
+}
+
+Copy Pgsql::createCopy(string tableName) {
+	return Copy(conn, tableName, debug);
 }
 
 void Pgsql::begin(void) {
+#ifdef LIBPQ_HAS_PIPELINING
+	// Statements of the set are queued without waiting for each other's
+	// results, which are collected at the sync points
+	if (pipeline && PQenterPipelineMode(conn) == 1) {
+		if (PQsendQueryParams(conn, "BEGIN", 0, NULL, NULL, NULL, NULL, 0)
+				== 0) {
+			cerr << "error: failed to send BEGIN;" << endl;
+			cerr << PQerrorMessage(conn);
+		}
+		return;
+	}
+#endif
+
 	// if query fails to send
 	if (PQsendQuery(conn, "BEGIN") == 0) {
 		cerr << "error: failed to send BEGIN;" << endl;
@@ -136,7 +382,43 @@ void Pgsql::begin(void) {
 	}
 }
 
-void Pgsql::commit(void) {
+// Put the session back in a known state after a failed set; every failed
+// transaction ends here. Statements prepared inside it may or may not
+// exist now, so all of them are dropped and prepared again on next use.
+// Reserved set_ids are given up too: the set may go to the spool, and
+// sets stored from there must not end up with higher ids than the ones
+// taken after them.
+void Pgsql::rollback(void) {
+	Metrics::count(Metrics::DB_ERRORS);
+	set_ids.clear();
+	PGresult *res = PQexec(conn, "ROLLBACK; DEALLOCATE ALL");
+	PQclear(res);
+	Prepare::clearPrepares(conn);
+}
+
+bool Pgsql::commit(void) {
+	Metrics::Timer timer(Metrics::COMMIT);
+	bool ok = true;
+
+#ifdef LIBPQ_HAS_PIPELINING
+	if (PQpipelineStatus(conn) != PQ_PIPELINE_OFF) {
+		if (PQsendQueryParams(conn, "COMMIT", 0, NULL, NULL, NULL, NULL, 0)
+				== 0) {
+			cerr << "error: failed to send COMMIT;" << endl;
+			cerr << PQerrorMessage(conn);
+			ok = false;
+		}
+
+		// A failed statement aborts the rest of the pipeline, COMMIT included
+		ok = syncPipeline(conn) && ok;
+		PQexitPipelineMode(conn);
+		if (ok == false) {
+			rollback();
+		}
+		return ok;
+	}
+#endif
+
 	if (PQconsumeInput(conn) == 0) {
 		cerr << "error: failed to PQconsumeinput while in commit()" << endl;
 		cerr << PQerrorMessage(conn);
@@ -144,6 +426,7 @@ void Pgsql::commit(void) {
 
 	int8_t rc = 0;
 	while ((rc = PQflush(conn)) == 1) {
+		Metrics::count(Metrics::FLUSH_WAITS);
 		if (debug) {
 			cerr << "PQflush in commit() had to wait" << endl;
 		}
@@ -154,10 +437,14 @@ void Pgsql::commit(void) {
 	if (rc != 0) {
 		cerr << "error: failed to PQflush while in commit()" << endl;
 		cerr << PQerrorMessage(conn);
+		ok = false;
 	}
 
 	PGresult *res;
 	while ((res = PQgetResult(conn)) != NULL) {
+		if (PQresultStatus(res) == PGRES_FATAL_ERROR) {
+			ok = false;
+		}
 		PQclear(res);
 	}
 
@@ -165,13 +452,52 @@ void Pgsql::commit(void) {
 	if (PQsendQuery(conn, "COMMIT") == 0) {
 		cerr << "error: failed to send COMMIT;" << endl;
 		cerr << PQerrorMessage(conn);
+		Metrics::count(Metrics::DB_ERRORS);
+		return false;
+	}
+
+	// Collect the COMMIT result so the connection is idle for the next set
+	while ((res = PQgetResult(conn)) != NULL) {
+		if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+			cerr << "error: COMMIT failed: " << PQresultErrorMessage(res);
+			ok = false;
+		} else if (strcmp(PQcmdStatus(res), "COMMIT") != 0) {
+			// An earlier error aborted the transaction and COMMIT rolled back
+			cerr << "error: transaction was rolled back" << endl;
+			ok = false;
+		}
+		PQclear(res);
+	}
+
+	if (ok == false) {
+		rollback();
 	}
+
+	return ok;
 }
 
 
 Prepare::Prepare(PGconn *conn, string prepareID, bool debug_value) :
-		conn(conn), prepareID(prepareID), debug(debug_value), lastResult(0)  {
+		conn(conn), prepareID(prepareID), column(0), frozen(false),
+		debug(debug_value), lastResult(0)  {
+
+}
 
+void Prepare::clearPrepares(PGconn *conn) {
+	lock_guard<mutex> guard(prepares_lock);
+	existing_prepares.erase(conn);
+}
+
+bool Prepare::isPrepared(void) {
+	lock_guard<mutex> guard(prepares_lock);
+	map<PGconn *, set<string> >::iterator session = existing_prepares.find(conn);
+	return session != existing_prepares.end()
+			&& session->second.count(prepareID) > 0;
+}
+
+void Prepare::markPrepared(void) {
+	lock_guard<mutex> guard(prepares_lock);
+	existing_prepares[conn].insert(prepareID);
 }
 
 void Prepare::setTableName(string tableName) {
@@ -186,92 +512,120 @@ void Prepare::setPrepareID(string prepareID) {
 	this->prepareID = prepareID;
 }
 
-void Prepare::addCol(string colName, int32_t value) {
+// Reserve length bytes in the row buffer for the next column's value.
+// Without a name the value is for the next declared column.
+char *Prepare::addParam(const string *colName, Oid type, int format,
+		int length) {
 	if (tableName.empty())
 		throw emptyName();
 
 	if (prepareID.empty())
 		throw emptyPrepareID();
 
-	stringstream ss;
-	ss << value;
+	if (column == params.size()) {
+		if (frozen || colName == NULL)
+			throw columnMismatch();
+
+		Param p;
+		p.name = *colName;
+		p.type = type;
+		p.format = format;
+		params.push_back(p);
+	} else if (params[column].type != type
+			|| (colName != NULL && params[column].name != *colName)) {
+		throw columnMismatch();
+	}
 
-	current_prepare.push_back(make_pair(colName, ss.str().c_str()));
-}
+	Param &p = params[column++];
+	p.offset = data.size();
+	p.length = length;
+	data.resize(data.size() + length);
 
-void Prepare::addCol(string colName, uint32_t value) {
-	if (tableName.empty())
-		throw emptyName();
-
-	if (prepareID.empty())
-		throw emptyPrepareID();
+	return data.data() + p.offset;
+}
 
-	stringstream ss;
-	ss << value;
+void Prepare::addCol(string colName, int32_t value) {
+	uint32_t n = htonl(value);
+	memcpy(addParam(&colName, INT4OID, 1, sizeof(n)), &n, sizeof(n));
+}
 
-	current_prepare.push_back(make_pair(colName, ss.str().c_str()));
+// int8 so that values above INT32_MAX survive
+void Prepare::addCol(string colName, uint32_t value) {
+	uint64_t n = htobe64(value);
+	memcpy(addParam(&colName, INT8OID, 1, sizeof(n)), &n, sizeof(n));
 }
 
 void Prepare::addCol(string colName, char value) {
-	if (tableName.empty())
-		throw emptyName();
-
-	if (prepareID.empty())
-		throw emptyPrepareID();
-
-	stringstream ss;
-	ss << value;
-
-	current_prepare.push_back(make_pair(colName, ss.str().c_str()));
+	*addParam(&colName, CHAROID, 1, 1) = value;
 }
 
 void Prepare::addCol(string colName, uint64_t value) {
-	if (tableName.empty())
-		throw emptyName();
-
-	if (prepareID.empty())
-		throw emptyPrepareID();
-
-	stringstream ss;
-	ss << value;
-
-	current_prepare.push_back(make_pair(colName, ss.str().c_str()));
+	uint64_t n = htobe64(value);
+	memcpy(addParam(&colName, INT8OID, 1, sizeof(n)), &n, sizeof(n));
 }
 
 void Prepare::addCol(string colName, int64_t value) {
-	if (tableName.empty())
-		throw emptyName();
-
-	if (prepareID.empty())
-		throw emptyPrepareID();
+	uint64_t n = htobe64(value);
+	memcpy(addParam(&colName, INT8OID, 1, sizeof(n)), &n, sizeof(n));
+}
 
-	stringstream ss;
-	ss << value;
+void Prepare::addCol(string colName, char *value) {
+	size_t length = strlen(value);
+	memcpy(addParam(&colName, TEXTOID, 1, length), value, length);
+}
 
-	current_prepare.push_back(make_pair(colName, ss.str().c_str()));
+void Prepare::addCol(string colName, const string &value) {
+	memcpy(addParam(&colName, TEXTOID, 1, value.size()), value.data(),
+			value.size());
 }
 
-void Prepare::addCol(string colName, char *value) {
-	if (tableName.empty())
-		throw emptyName();
+// Binary timestamptz is microseconds since 2000-01-01 UTC on servers with
+// integer datetimes, the only kind built since 10. Others get text.
+void Prepare::addCol(string colName, const Clock &value) {
+	const char *integer_datetimes = PQparameterStatus(conn, "integer_datetimes");
+	if (integer_datetimes != NULL && strcmp(integer_datetimes, "on") == 0) {
+		uint64_t n = htobe64(value.pgMicroseconds());
+		memcpy(addParam(&colName, TIMESTAMPTZOID, 1, sizeof(n)), &n, sizeof(n));
+	} else {
+		string text = value.text();
+		memcpy(addParam(&colName, TIMESTAMPTZOID, 0, text.size() + 1),
+				text.c_str(), text.size() + 1);
+	}
+}
 
-	if (prepareID.empty())
-		throw emptyPrepareID();
+void Prepare::declareCol(const string &colName, Oid type) {
+	if (frozen || column > 0)
+		throw columnMismatch();
+
+	Param p;
+	p.name = colName;
+	p.type = type;
+	p.format = 1;
+	p.offset = 0;
+	p.length = 0;
+	params.push_back(p);
+}
 
-	stringstream ss;
-	ss << value;
+void Prepare::add(int32_t value) {
+	uint32_t n = htonl(value);
+	memcpy(addParam(NULL, INT4OID, 1, sizeof(n)), &n, sizeof(n));
+}
 
-	current_prepare.push_back(make_pair(colName, ss.str().c_str()));
+void Prepare::add(int64_t value) {
+	uint64_t n = htobe64(value);
+	memcpy(addParam(NULL, INT8OID, 1, sizeof(n)), &n, sizeof(n));
 }
 
-void Prepare::addCol(string colName, string &value) {
-	if (tableName.empty())
-		throw emptyName();
+void Prepare::add(char value) {
+	*addParam(NULL, CHAROID, 1, 1) = value;
+}
 
-	if (prepareID.empty())
-		throw emptyPrepareID();
+void Prepare::add(const string &value) {
+	add(value.data(), value.size());
+}
 
-	current_prepare.push_back(make_pair(colName, value));
+void Prepare::add(const char *value, size_t length) {
+	memcpy(addParam(NULL, TEXTOID, 1, length), value, length);
 }
 
 void Prepare::where(string ws, int wd) {
@@ -290,47 +644,102 @@ void Prepare::where(string ws, char *wd) {
 	whereData = ss.str();
 }
 
+// Start the next row; the buffers keep their capacity. The value
+// pointers taken for the row stay valid until the next add.
+void Prepare::endRow(void) {
+	column = 0;
+	frozen = true;
+	data.clear();
+}
+
 void Prepare::exec(void) {
+	if (column != params.size())
+		throw columnMismatch();
+
 	// Number of parameters in the current prepare
-	int nParams = current_prepare.size();
+	int nParams = params.size();
 	if (whereString.size() > 0) {
 		nParams++;
 	}
 
-	// Check if prepare exists already
-	PGresult *res = Prepare::existing_prepares[prepareID];
-
-	// If not or existing one is bad, create a new one
-	if ((res == 0) || (PQresultStatus(res) != PGRES_COMMAND_OK)) {
+	string query;
+	bool prepared = isPrepared();
+	if (prepared == false) {
 		// Perform update
-		string query;
 		if (whereString.size() > 0) {
 			query = generateUpdateQuery();
 		} else {
 			query = generateInsertQuery();
 		}
+	}
+
+	// The row buffer may have moved while it grew, so the value pointers
+	// are only taken now
+	paramValues.resize(nParams);
+	paramLengths.resize(nParams);
+	paramFormats.resize(nParams);
+	paramTypes.resize(nParams);
+	size_t i = 0;
+	for (; i < params.size(); ++i) {
+		paramValues[i] = data.data() + params[i].offset;
+		paramLengths[i] = params[i].length;
+		paramFormats[i] = params[i].format;
+		paramTypes[i] = params[i].type;
+	}
+
+	// Perform update
+	if (whereString.size() > 0) {
+		paramValues[i] = whereData.c_str();
+		paramLengths[i] = 0;
+		paramFormats[i] = 0;
+		paramTypes[i] = InvalidOid;
+	}
+
+	endRow();
+
+#ifdef LIBPQ_HAS_PIPELINING
+	// In a pipeline nothing waits here; a failed prepare or insert shows up
+	// when Pgsql syncs the pipeline
+	if (PQpipelineStatus(conn) != PQ_PIPELINE_OFF) {
+		if (prepared == false) {
+			Metrics::Timer timer(Metrics::PREPARE);
+			if (PQsendPrepare(conn, prepareID.c_str(), query.c_str(), nParams,
+					&paramTypes[0]) == 0) {
+				cerr << "Error occurred trying to prepare SQL: "
+						<< PQerrorMessage(conn) << endl;
+				return;
+			}
+			markPrepared();
+		}
+
+		Metrics::Timer timer(Metrics::SEND);
+		if (PQsendQueryPrepared(conn, prepareID.c_str(), nParams,
+				&paramValues[0], &paramLengths[0], &paramFormats[0], 0) == 0) {
+			cerr << "Error occurred trying to send prepared SQL: "
+					<< PQerrorMessage(conn) << endl;
+		}
 
-		res = PQprepare(conn, prepareID.c_str(), query.c_str(), nParams, NULL);
+		// Read whatever results have arrived so the server never stalls
+		// on a full socket while we keep sending
+		PQflush(conn);
+		PQconsumeInput(conn);
+		return;
+	}
+#endif
+
+	if (prepared == false) {
+		Metrics::Timer timer(Metrics::PREPARE);
+		PGresult *res = PQprepare(conn, prepareID.c_str(), query.c_str(),
+				nParams, &paramTypes[0]);
 		if (PQresultStatus(res) != PGRES_COMMAND_OK) {
 			cerr << "Error occurred trying to prepare SQL: "
 					<< PQresultErrorMessage(res) << endl;
 			PQclear(res);
 			return;
 		}
+		PQclear(res);
 
-		Prepare::existing_prepares[prepareID] = res;
-	}
-
-	const char * *paramValues = new const char *[nParams];
-	int i = 0;
-	for (PrepareVector::iterator j = current_prepare.begin();
-			j != current_prepare.end(); j++) {
-		paramValues[i++] = j->second.c_str();
-	}
-
-	// Perform update
-	if (whereString.size() > 0) {
-		paramValues[i] = whereData.c_str();
+		markPrepared();
 	}
 
 	if (PQconsumeInput(conn) == 0) {
@@ -338,21 +747,14 @@ void Prepare::exec(void) {
 		cerr << PQerrorMessage(conn);
 	}
 
+	Metrics::Timer timer(Metrics::SEND);
 	if (lastResult) {
 		PQclear(lastResult);
 	}
-	lastResult = PQgetResult(conn);
-	if (lastResult != NULL && PQresultStatus(lastResult) != PGRES_COMMAND_OK) {
-				cerr << "Error occurred trying to prepare SQL: "
-						<< PQresultErrorMessage(lastResult) << endl;
-	}
-	PQclear(lastResult);
-
-	lastResult = PQgetResult(conn);
-	while (lastResult != NULL) {
+	while ((lastResult = PQgetResult(conn)) != NULL) {
 		if (PQresultStatus(lastResult) != PGRES_COMMAND_OK) {
-					cerr << "Error occurred trying to prepare SQL: "
-							<< PQresultErrorMessage(lastResult) << endl;
+			cerr << "Error occurred trying to prepare SQL: "
+					<< PQresultErrorMessage(lastResult) << endl;
 		}
 		PQclear(lastResult);
 		usleep(1);
@@ -360,21 +762,27 @@ void Prepare::exec(void) {
 
 	//lastResult = res = PQexecPrepared(this->conn, prepareID.c_str(), nParams, paramValues, NULL, NULL, 0);
 	int status = PQsendQueryPrepared(this->conn, prepareID.c_str(), nParams,
-			paramValues, NULL, NULL, 0);
+			&paramValues[0], &paramLengths[0], &paramFormats[0], 0);
 
 	if (status == 0) {
 		cerr << status << " Error occurred trying to prepare SQL: "
 				<< PQerrorMessage(conn) << endl;
 	}
-
-	delete[] paramValues;
 }
 
 Oid Prepare::getResult(void) {
-	Oid o;
+	Oid o = InvalidOid;
 
 	if (lastResult)
 		PQclear(lastResult);
+	lastResult = NULL;
+
+#ifdef LIBPQ_HAS_PIPELINING
+	if (PQpipelineStatus(conn) != PQ_PIPELINE_OFF) {
+		syncPipeline(conn);
+		return o;
+	}
+#endif
 
 	while ((lastResult = PQgetResult(conn)) != NULL) {
 		o = PQoidValue(lastResult);
@@ -393,16 +801,15 @@ string Prepare::generateInsertQuery(void) {
 	stringstream sql;
 	sql << "INSERT INTO " << tableName << " (";
 
-	PrepareVector::iterator index;
-	for (index = current_prepare.begin(); index != current_prepare.end();
-			index++) {
-		sql << index->first;
-		if (index + 1 != current_prepare.end())
+	vector<Param>::iterator index;
+	for (index = params.begin(); index != params.end(); index++) {
+		sql << index->name;
+		if (index + 1 != params.end())
 			sql << ", ";
 	}
 
 	sql << ") VALUES (";
-	int numCols = current_prepare.size();
+	int numCols = params.size();
 	for (int j = 0; j < numCols; j++) {
 		sql << "$" << j + 1;
 		if (j + 1 != numCols)
@@ -422,10 +829,10 @@ string Prepare::generateUpdateQuery(void) {
 	sql << "UPDATE " << tableName << " SET ";
 
 	int j = 1;
-	for (PrepareVector::iterator index = current_prepare.begin();
-			index != current_prepare.end(); index++) {
-		sql << index->first << " = $" << j++;
-		if (index + 1 != current_prepare.end())
+	for (vector<Param>::iterator index = params.begin();
+			index != params.end(); index++) {
+		sql << index->name << " = $" << j++;
+		if (index + 1 != params.end())
 			sql << ", ";
 	}
 
@@ -441,3 +848,452 @@ Prepare::~Prepare() {
 	if (lastResult)
 		PQclear(lastResult);
 }
+
+Copy::Copy(PGconn *conn, string tableName, bool debug_value) :
+		conn(conn), tableName(tableName), format(BINARY), debug(debug_value),
+		started(false), field(0), rows(0) {
+
+}
+
+void Copy::addCol(string colName) {
+	if (tableName.empty())
+		throw emptyName();
+
+	columns.push_back(colName);
+}
+
+void Copy::setFormat(Format format) {
+	this->format = format;
+}
+
+Copy::Format Copy::getFormat(void) {
+	return format;
+}
+
+size_t Copy::getRows(void) {
+	return rows;
+}
+
+bool Copy::binarySupported(Oid type) {
+	switch (type) {
+	case CHAROID:
+	case INT2OID:
+	case INT4OID:
+	case INT8OID:
+	case TEXTOID:
+	case BPCHAROID:
+	case VARCHAROID:
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool Copy::lookupTypes(void) {
+	map<string, Oid> table;
+	{
+		lock_guard<mutex> guard(column_types_lock);
+		map<string, map<string, Oid> >::iterator cached = column_types.find(
+				tableName);
+		if (cached != column_types.end())
+			table = cached->second;
+	}
+
+	if (table.empty()) {
+		const char *paramValues[1] = { tableName.c_str() };
+		PGresult *res =
+				PQexecParams(conn,
+						"SELECT attname, atttypid FROM pg_catalog.pg_attribute"
+								" WHERE attrelid = $1::regclass AND attnum > 0 AND NOT attisdropped",
+						1, NULL, paramValues, NULL, NULL, 0);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+			cerr << "Error occurred looking up columns of " << tableName
+					<< ": " << PQresultErrorMessage(res) << endl;
+			PQclear(res);
+			return false;
+		}
+
+		for (int i = 0; i < PQntuples(res); ++i) {
+			table[PQgetvalue(res, i, 0)] = strtoul(PQgetvalue(res, i, 1), NULL,
+					10);
+		}
+		PQclear(res);
+
+		lock_guard<mutex> guard(column_types_lock);
+		column_types[tableName] = table;
+	}
+
+	types.clear();
+	for (vector<string>::iterator i = columns.begin(); i != columns.end(); ++i) {
+		map<string, Oid>::iterator type = table.find(*i);
+		if (type == table.end()) {
+			cerr << "Column " << *i << " not found in " << tableName << endl;
+			return false;
+		}
+		types.push_back(type->second);
+	}
+
+	return true;
+}
+
+// Statements in before are sent in the same message as the COPY, so they
+// cost no round trip of their own. They must not return rows.
+bool Copy::begin(const string &before) {
+	if (tableName.empty())
+		throw emptyName();
+
+#ifdef LIBPQ_HAS_PIPELINING
+	// COPY is not allowed in pipeline mode
+	if (PQpipelineStatus(conn) != PQ_PIPELINE_OFF) {
+		bool ok = syncPipeline(conn);
+		PQexitPipelineMode(conn);
+		if (ok == false) {
+			return false;
+		}
+	}
+#endif
+
+	// Results of statements sent earlier must be collected before COPY
+	PGresult *res;
+	while ((res = PQgetResult(conn)) != NULL) {
+		if (PQresultStatus(res) != PGRES_COMMAND_OK
+				&& PQresultStatus(res) != PGRES_TUPLES_OK) {
+			cerr << "Error occurred before COPY: " << PQresultErrorMessage(res)
+					<< endl;
+		}
+		PQclear(res);
+	}
+
+	// Type lookup and starting the COPY are its prepare phase
+	Metrics::Timer timer(Metrics::PREPARE);
+
+	// (FORMAT binary) syntax is 9.0+, older servers only get text COPY
+	if (format == BINARY && PQserverVersion(conn) < 90000) {
+		format = TEXT;
+	}
+
+	if (format == BINARY) {
+		if (lookupTypes() == false) {
+			format = TEXT;
+		}
+		for (vector<Oid>::iterator i = types.begin(); i != types.end(); ++i) {
+			if (binarySupported(*i) == false) {
+				format = TEXT;
+				break;
+			}
+		}
+		if (format == TEXT) {
+			cerr << "Binary COPY into " << tableName
+					<< " is not possible, falling back to text COPY" << endl;
+		}
+	}
+
+	stringstream sql;
+	if (before.empty() == false)
+		sql << before << "; ";
+	sql << "COPY " << tableName << " (";
+	for (vector<string>::iterator i = columns.begin(); i != columns.end(); ++i) {
+		sql << *i;
+		if (i + 1 != columns.end())
+			sql << ", ";
+	}
+	sql << ") FROM STDIN";
+	if (format == BINARY)
+		sql << " (FORMAT binary)";
+
+	if (debug) {
+		cerr << sql.str() << endl;
+	}
+
+	res = PQexec(conn, sql.str().c_str());
+	if (PQresultStatus(res) != PGRES_COPY_IN) {
+		cerr << "Error occurred trying to start COPY: "
+				<< PQresultErrorMessage(res) << endl;
+		PQclear(res);
+		return false;
+	}
+	PQclear(res);
+
+	buffer.clear();
+	buffer.reserve(copy_chunk + copy_chunk / 2);
+	if (format == BINARY) {
+		buffer.append(copy_signature, sizeof(copy_signature));
+		appendInt32(buffer, 0); // flags
+		appendInt32(buffer, 0); // header extension length
+	}
+
+	error.clear();
+	field = 0;
+	rows = 0;
+	started = true;
+
+	return true;
+}
+
+void Copy::nextField(void) {
+	if (started == false)
+		throw notStarted();
+
+	if (field == 0 && format == BINARY) {
+		appendInt16(buffer, columns.size());
+	} else if (field > 0 && format == TEXT) {
+		buffer += '\t';
+	}
+
+	if (field >= columns.size() && error.empty()) {
+		stringstream ss;
+		ss << "too many fields in row " << rows + 1 << " of COPY into "
+				<< tableName;
+		error = ss.str();
+	}
+}
+
+void Copy::addInteger(int64_t value) {
+	nextField();
+
+	char text[24];
+	size_t length = formatDecimal(text, value);
+
+	if (format == TEXT) {
+		buffer.append(text, length);
+	} else {
+		Oid type = field < types.size() ? types[field] : InvalidOid;
+		switch (type) {
+		case INT2OID:
+			if (value < numeric_limits<int16_t>::min()
+					|| value > numeric_limits<int16_t>::max())
+				break;
+			appendInt32(buffer, sizeof(int16_t));
+			appendInt16(buffer, value);
+			field++;
+			return;
+		case INT4OID:
+			if (value < numeric_limits<int32_t>::min()
+					|| value > numeric_limits<int32_t>::max())
+				break;
+			appendInt32(buffer, sizeof(int32_t));
+			appendInt32(buffer, value);
+			field++;
+			return;
+		case INT8OID:
+			appendInt32(buffer, sizeof(int64_t));
+			appendInt64(buffer, value);
+			field++;
+			return;
+		case TEXTOID:
+		case BPCHAROID:
+		case VARCHAROID:
+			appendInt32(buffer, length);
+			buffer.append(text, length);
+			field++;
+			return;
+		}
+
+		// Keep the stream well formed, the COPY is aborted in end()
+		appendInt32(buffer, -1);
+		if (error.empty() && field < columns.size()) {
+			error = string("value ") + string(text, length)
+					+ " does not fit column " + columns[field];
+		}
+	}
+	field++;
+}
+
+void Copy::addText(const char *value, size_t length) {
+	nextField();
+
+	if (format == TEXT) {
+		for (size_t i = 0; i < length; ++i) {
+			switch (value[i]) {
+			case '\\':
+				buffer += "\\\\";
+				break;
+			case '\n':
+				buffer += "\\n";
+				break;
+			case '\r':
+				buffer += "\\r";
+				break;
+			case '\t':
+				buffer += "\\t";
+				break;
+			default:
+				buffer += value[i];
+			}
+		}
+	} else {
+		Oid type = field < types.size() ? types[field] : InvalidOid;
+		if (type == CHAROID && length > 1) {
+			length = 1;
+		}
+		if (type == CHAROID || type == TEXTOID || type == BPCHAROID
+				|| type == VARCHAROID) {
+			appendInt32(buffer, length);
+			buffer.append(value, length);
+		} else {
+			appendInt32(buffer, -1);
+			if (error.empty() && field < columns.size()) {
+				error = "text value does not fit column " + columns[field];
+			}
+		}
+	}
+	field++;
+}
+
+void Copy::add(int32_t value) {
+	addInteger(value);
+}
+
+void Copy::add(uint32_t value) {
+	addInteger(value);
+}
+
+void Copy::add(int64_t value) {
+	addInteger(value);
+}
+
+void Copy::add(uint64_t value) {
+	if (value > uint64_t(numeric_limits<int64_t>::max())) {
+		nextField();
+		if (format == BINARY)
+			appendInt32(buffer, -1);
+		if (error.empty() && field < columns.size())
+			error = "value does not fit column " + columns[field];
+		field++;
+		return;
+	}
+	addInteger(value);
+}
+
+void Copy::add(char value) {
+	addText(&value, 1);
+}
+
+void Copy::add(const string &value) {
+	addText(value.data(), value.size());
+}
+
+void Copy::add(char *value) {
+	addText(value, strlen(value));
+}
+
+void Copy::add(const char *value, size_t length) {
+	addText(value, length);
+}
+
+void Copy::endRow(void) {
+	if (started == false)
+		throw notStarted();
+
+	if (field != columns.size() && error.empty()) {
+		stringstream ss;
+		ss << "row " << rows + 1 << " of COPY into " << tableName << " has "
+				<< field << " fields, expected " << columns.size();
+		error = ss.str();
+	}
+
+	if (format == TEXT)
+		buffer += '\n';
+
+	field = 0;
+	rows++;
+
+	if (buffer.size() >= copy_chunk) {
+		putData(buffer.data(), buffer.size());
+		buffer.clear();
+	}
+}
+
+bool Copy::wait(bool forWrite) {
+	pollfd pfd;
+	pfd.fd = PQsocket(conn);
+	pfd.events = forWrite ? POLLIN | POLLOUT : POLLIN;
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, 1000) < 0) {
+		perror("poll");
+		return false;
+	}
+
+	// Let libpq see notices or an error the server sent mid-COPY
+	if ((pfd.revents & POLLIN) && PQconsumeInput(conn) == 0) {
+		cerr << PQerrorMessage(conn);
+		return false;
+	}
+
+	return true;
+}
+
+bool Copy::putData(const char *data, size_t length) {
+	Metrics::Timer timer(Metrics::SEND);
+	int rc;
+	while ((rc = PQputCopyData(conn, data, length)) == 0) {
+		Metrics::count(Metrics::FLUSH_WAITS);
+		if (wait(true) == false)
+			return false;
+	}
+
+	if (rc < 0) {
+		cerr << "Error sending COPY data: " << PQerrorMessage(conn);
+		return false;
+	}
+
+	return true;
+}
+
+bool Copy::end(void) {
+	if (started == false)
+		throw notStarted();
+	started = false;
+
+	if (field != 0 && error.empty())
+		error = "incomplete last row in COPY into " + tableName;
+
+	bool ok = true;
+	if (error.empty()) {
+		if (format == BINARY)
+			appendInt16(buffer, -1); // file trailer
+		ok = putData(buffer.data(), buffer.size());
+	}
+	buffer.clear();
+
+	int rc;
+	while ((rc = PQputCopyEnd(conn, error.empty() ? NULL : error.c_str()))
+			== 0) {
+		if (wait(true) == false)
+			break;
+	}
+	while ((rc = PQflush(conn)) == 1) {
+		Metrics::count(Metrics::FLUSH_WAITS);
+		if (wait(true) == false)
+			break;
+	}
+	if (rc != 0) {
+		cerr << "Error ending COPY: " << PQerrorMessage(conn);
+		ok = false;
+	}
+
+	PGresult *res;
+	while ((res = PQgetResult(conn)) != NULL) {
+		if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+			cerr << "Error occurred during COPY into " << tableName << ": "
+					<< PQresultErrorMessage(res) << endl;
+			ok = false;
+		}
+		PQclear(res);
+	}
+
+	if (ok == false) {
+		Metrics::count(Metrics::DB_ERRORS);
+	}
+
+	if (debug) {
+		cerr << "COPY " << rows << " rows into " << tableName << " ("
+				<< (format == BINARY ? "binary" : "text") << ")" << endl;
+	}
+
+	return ok;
+}
+
+Copy::~Copy() {
+}
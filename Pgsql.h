@@ -27,26 +27,83 @@ extern "C" {
 #include <pgsql/postgres_ext.h>
 }
 
+#include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <queue>
+#include <mutex>
 
 using namespace std;
 
-typedef vector<pair<string, string> > PrepareVector;
-
+// Type OIDs from the server's pg_type.h, which libpq does not install
+#ifndef CHAROID
+#define CHAROID 18
+#endif
+#ifndef INT8OID
+#define INT8OID 20
+#endif
+#ifndef INT2OID
+#define INT2OID 21
+#endif
+#ifndef INT4OID
+#define INT4OID 23
+#endif
+#ifndef TEXTOID
+#define TEXTOID 25
+#endif
+#ifndef BPCHAROID
+#define BPCHAROID 1042
+#endif
+#ifndef VARCHAROID
+#define VARCHAROID 1043
+#endif
+#ifndef TIMESTAMPTZOID
+#define TIMESTAMPTZOID 1184
+#endif
+
+class Clock;
+
+// A prepared INSERT (or UPDATE with where()) that is executed once per row.
+// Each addCol() overload declares the parameter's PostgreSQL type and
+// writes the value in binary format into a buffer that is reused from row
+// to row; exec() sends the row and starts the next one. Every row must add
+// the same columns in the same order as the first. Alternatively the
+// columns are declared once with declareCol() and each row only add()s
+// the values in that order.
 class Prepare {
 private:
+	struct Param {
+		string name;
+		Oid type;
+		int format;
+		size_t offset;
+		int length;
+	};
+
 	string generateInsertQuery(void);
 	string generateUpdateQuery(void);
-	static map<string, PGresult *> existing_prepares;
+	char *addParam(const string *colName, Oid type, int format, int length);
+	void endRow(void);
+	// Statements prepared so far in each session
+	static map<PGconn *, set<string> > existing_prepares;
+	static mutex prepares_lock;
+	bool isPrepared(void);
+	void markPrepared(void);
 	PGconn *conn;
 
 	string tableName;
 	string prepareID;
 	string whereString;
 	string whereData;
-	PrepareVector current_prepare;
+	vector<Param> params;
+	size_t column;
+	bool frozen;
+	vector<char> data;
+	vector<const char *> paramValues;
+	vector<int> paramLengths;
+	vector<int> paramFormats;
+	vector<Oid> paramTypes;
 	bool debug;
 
 public:
@@ -56,12 +113,19 @@ public:
 	void setConn(PGconn *conn);
 	void setPrepareID(string prepareID);
 	void addCol(string colName, char * value);
-	void addCol(string colName, string &value);
+	void addCol(string colName, const string &value);
 	void addCol(string colName, char value);
 	void addCol(string colName, uint64_t value);
 	void addCol(string colName, int64_t value);
 	void addCol(string colName, uint32_t value);
 	void addCol(string colName, int32_t value);
+	void addCol(string colName, const Clock &value);
+	void declareCol(const string &colName, Oid type);
+	void add(int32_t value);
+	void add(int64_t value);
+	void add(char value);
+	void add(const string &value);
+	void add(const char *value, size_t length);
 	void where(string ws, int wd);
 	void where(string ws, char * wd);
 	void exec(void);
@@ -69,6 +133,7 @@ public:
 	void enableDebug(void);
 	void disableDebug(void);
 	bool getDebug(void);
+	static void clearPrepares(PGconn *conn);
 	PGresult *lastResult;
 
 	// Exceptions
@@ -76,26 +141,102 @@ public:
 	};
 	class emptyPrepareID {
 	};
+	class columnMismatch {
+	};
 
 	friend int main(int argc, char *argv[]);
+	friend class Bench;
 };
 
+// Streams rows into a table with COPY ... FROM STDIN. Binary format is used
+// when the server and every target column type support it, otherwise the
+// rows are sent as text COPY.
+class Copy {
+public:
+	enum Format {
+		BINARY, TEXT
+	};
 
+private:
+	static map<string, map<string, Oid> > column_types;
+	static mutex column_types_lock;
+	PGconn *conn;
+
+	string tableName;
+	vector<string> columns;
+	vector<Oid> types;
+	Format format;
+	bool debug;
+	bool started;
+	string buffer;
+	size_t field;
+	size_t rows;
+	string error;
+
+	bool lookupTypes(void);
+	bool binarySupported(Oid type);
+	void nextField(void);
+	void addInteger(int64_t value);
+	void addText(const char *value, size_t length);
+	bool putData(const char *data, size_t length);
+	bool wait(bool forWrite);
+
+public:
+	Copy(PGconn *conn, string tableName, bool debug_value = false);
+	~Copy();
+	void addCol(string colName);
+	void setFormat(Format format);
+	Format getFormat(void);
+	bool begin(const string &before = string());
+	void add(char *value);
+	void add(const string &value);
+	void add(const char *value, size_t length);
+	void add(char value);
+	void add(uint64_t value);
+	void add(int64_t value);
+	void add(uint32_t value);
+	void add(int32_t value);
+	void endRow(void);
+	bool end(void);
+	size_t getRows(void);
+
+	// Exceptions
+	class emptyName {
+	};
+	class notStarted {
+	};
+};
+
+// One session with the server. Each instance has its own connection, so a
+// thread that stores sets uses a Pgsql of its own.
 class Pgsql {
 private:
-	static PGconn *conn;
+	PGconn *conn;
 	queue<Prepare> execqueue;
 	bool debug;
+	bool pipeline;
+	size_t set_id_block;
+	vector<uint64_t> set_ids;
+	void rollback(void);
 public:
 	Pgsql(const char dbhost[], const char dbname[], const char dbuser[], const char dbpass[], const bool debug_value);
 	Prepare createPrepare(string prepare_id);
+	Copy createCopy(string tableName);
 	void begin(void);
-	void commit(void);
+	bool commit(void);
+	void enqueue(const Prepare &p);
 	void processqueue(void);
-	uint64_t lastval(void);
+	bool nextSetId(uint64_t &id);
+	string literal(const string &value);
+	PGresult *exec(const string &query, const vector<string> &values);
+	bool connected(void);
+	bool reconnect(void);
 	void enableDebug(void);
 	void disableDebug(void);
 	bool getDebug(void);
+	void enablePipeline(void);
+	void disablePipeline(void);
+	bool getPipeline(void);
 	virtual ~Pgsql();
 
 	// Exceptions
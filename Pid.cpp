@@ -18,106 +18,272 @@
  */
 
 #include <iostream>
-#include <sstream>
-#include <fstream>
 #include <string>
-#include <algorithm>
-#include <linux/limits.h>
 #include <string.h>
+#include <stdio.h>
+#include <unistd.h>
 #include "Pid.h"
+#include "Clock.h"
+#include "ProcReader.h"
+#include "Taskstats.h"
+#include "TextScan.h"
 
 using namespace std;
 
-Pid::Pid(char number[]) {
+bool Pid::times = false;
+long Pid::page_kb = sysconf(_SC_PAGESIZE) / 1024;
+int64_t Pid::tick_ns = 0;
+
+// An empty process that a decoder fills in
+Pid::Pid(void) {
+	reset();
+}
+
+Pid::Pid(const char number[]) {
+	read(number);
+}
+
+// The strings are cleared rather than replaced, so a Pid that is read
+// again and again keeps their buffers
+void Pid::reset(void) {
+	found = false;
+	kthread = false;
+	cmdline.clear();
+	comm.clear();
+	stat_comm.clear();
 	mypid = 0;
-	istringstream(number) >> mypid;
-	mypid_s = string("/proc/") + number;
-	getcmdline();
-	getcomm();
-	getstat();
+	state = 0;
+	ppid = 0;
+	pgrp = 0;
+	session = 0;
+	tty_nr = 0;
+	tpgid = 0;
+	flags = 0;
+	minflt = 0;
+	cminflt = 0;
+	majflt = 0;
+	cmajflt = 0;
+	utime = 0;
+	stime = 0;
+	cutime = 0;
+	cstime = 0;
+	priority = 0;
+	nice = 0;
+	num_threads = 0;
+	itrealvalue = 0;
+	starttime = 0;
+	rss = 0;
+	cpu_delay = 0;
+	blkio_delay = 0;
+	swapin_delay = 0;
+	nvcsw = 0;
+	nivcsw = 0;
+	hiwater_rss = 0;
+	read_bytes = 0;
+	write_bytes = 0;
+	read_time = 0;
+	start_time = 0;
+	utime_rate = -1;
+	stime_rate = -1;
+	minflt_rate = -1;
+	majflt_rate = -1;
 }
 
-void Pid::getcmdline(void) {
-	string proc_cmdline = mypid_s + "/cmdline";
-	ifstream ifs(proc_cmdline.c_str(), ifstream::in);
+// Fill in read_time and start_time from here on. A process's times come
+// from the instant its stat was parsed, which for a scan of thousands of
+// processes can be well after the set's node_time.
+void Pid::recordTimes(void) {
+	times = true;
+	tick_ns = 1000000000 / sysconf(_SC_CLK_TCK);
+}
 
-	ifs.seekg(0, ifs.end);
-	streamsize length = ifs.tellg();
-	if (length > 0) {
-		ifs.seekg(0, ifs.beg);
-
-		char *buffer;
-		try {
-			buffer = new char [length];
-		} catch(...) {
-			cerr << "Error allocating " << sizeof(char)*(length) << " bytes." << endl;
-			exit(1);
-		}
-		ifs.read(buffer, length);
-		for (int i=0; i < length-1; ++i) {
-			if (buffer[i] == 0) {
-				buffer[i] = ' ';
-			}
-		}
+// Read the process with PID number, replacing what this Pid held. False if
+// it exited before it could be read.
+bool Pid::read(const char number[]) {
+	reset();
+	ProcReader::parseNumber(number, number + strlen(number), mypid);
+	getcmdline(number);
+	getcomm(number);
+	getstat(number);
+	if (found && Taskstats::enabled())
+		gettaskstats(number);
+	return found;
+}
 
-		cmdline = buffer;
-		delete[] buffer;
+// The same from the contents of cmdline, comm and stat that were read
+// elsewhere, a length of -1 for a file that could not be read. comm is
+// only looked at when cmdline is empty, and cmdline is changed in place.
+bool Pid::read(const char number[], char *cmdline, ssize_t cmdline_length,
+		const char *comm, ssize_t comm_length, const char *stat,
+		ssize_t stat_length) {
+	reset();
+	ProcReader::parseNumber(number, number + strlen(number), mypid);
+	setcmdline(cmdline, cmdline_length);
+	setcomm(comm, comm_length);
+	found = stat_length > 0 && parsestat(stat, stat_length);
+	if (found && Taskstats::enabled())
+		gettaskstats(number);
+	return found;
+}
+
+bool Pid::valid(void) const {
+	return found;
+}
+
+// Read /proc/#/stat again, keeping cmdline and comm. False once the
+// process is gone, or its PID belongs to a new process.
+bool Pid::update(void) {
+	char number[16];
+	uint64_t started = starttime;
+	snprintf(number, sizeof(number), "%d", mypid);
+	getstat(number);
+	if (found && Taskstats::enabled())
+		gettaskstats(number);
+	return found && starttime == started;
+}
+
+void Pid::getcmdline(const char number[]) {
+	char *buffer;
+	ssize_t length = ProcReader::read(number, "cmdline", buffer);
+	setcmdline(buffer, length);
+}
+
+void Pid::setcmdline(char *buffer, ssize_t length) {
+	// Arguments are NUL separated and the last one is NUL terminated
+	while (length > 0 && buffer[length - 1] == '\0')
+		--length;
+
+	if (length > 0) {
+		TextScan::nulToSpace(buffer, length);
+		cmdline.assign(buffer, length);
+	} else {
+		cmdline.clear();
 	}
-	ifs.close();
 }
 
-void Pid::getcomm(void) {
+void Pid::getcomm(const char number[]) {
+	char *buffer = NULL;
+	ssize_t length = -1;
+	if (cmdline.length() == 0)
+		length = ProcReader::read(number, "comm", buffer);
+	setcomm(buffer, length);
+}
+
+void Pid::setcomm(const char *buffer, ssize_t length) {
 	if (cmdline.length() == 0) {
-		string proc_comm = mypid_s + "/comm";
-		ifstream ifs(proc_comm.c_str(), ifstream::in);
-		ifs.seekg(0, ifs.end);
-		streamsize length = ifs.tellg();
+		while (length > 0 && (buffer[length - 1] == '\n' || buffer[length - 1] == '\0'))
+			--length;
+
 		if (length > 0) {
-			ifs.seekg(0, ifs.beg);
-
-			char *buffer;
-			try {
-				buffer = new char [length];
-			} catch(...) {
-				cerr << "Error allocating " << sizeof(char)*(length) << " bytes." << endl;
-				exit(1);
-			}
-			ifs.read(buffer, length);
-			for (int i=0; i < length-1; ++i) {
-				if (buffer[i] == 0) {
-					buffer[i] = ' ';
-				}
-			}
-
-			comm = buffer;
-			delete[] buffer;
+			comm.assign(buffer, length);
+		} else {
+			comm.clear();
 		}
-		ifs.close();
 		kthread = true;
 	} else {
 		kthread = false;
 	}
 }
 
-void Pid::getstat(void) {
-	string proc_stat = mypid_s + "/stat";
-	ifstream ifs(proc_stat.c_str(), ifstream::in);
-	ifs >> mypid >> stat_comm >> state >> ppid >> pgrp >> session >> tty_nr;
-    ifs >> tpgid >> flags >> minflt >> cminflt >> majflt >> cmajflt >> utime;
-	ifs >> stime >> cutime >> cstime >> priority >> nice >> num_threads;
+void Pid::getstat(const char number[]) {
+	char *buffer;
+	ssize_t length = ProcReader::read(number, "stat", buffer);
+	found = length > 0 && parsestat(buffer, length);
 }
 
-Pid::~Pid() {
+// utime and stime stay those of stat: the thread group times of taskstats
+// leave out threads that have exited and are zero for kernel threads. I/O
+// is counted per thread, so the main thread's figures are only the
+// process's when it has no other threads.
+void Pid::gettaskstats(const char number[]) {
+	struct taskstats ts;
+
+	if (Taskstats::process(mypid, ts)) {
+		cpu_delay = ts.cpu_delay_total;
+		blkio_delay = ts.blkio_delay_total;
+		swapin_delay = ts.swapin_delay_total;
+		nvcsw = ts.nvcsw;
+		nivcsw = ts.nivcsw;
+	}
+
+	if (Taskstats::thread(mypid, ts)) {
+		hiwater_rss = ts.hiwater_rss;
+		read_bytes = ts.read_bytes;
+		write_bytes = ts.write_bytes;
+	}
+
+	if (num_threads > 1)
+		getio(number);
+}
+
+void Pid::getio(const char number[]) {
+	char *buffer;
+	ssize_t length = ProcReader::read(number, "io", buffer);
+	if (length <= 0)
+		return;
+
+	const char *end = buffer + length;
+	const char *p = static_cast<const char *>(memmem(buffer, length,
+			"\nread_bytes:", 12));
+	if (p != NULL)
+		ProcReader::parseNumber(p + 12, end, read_bytes);
+	p = static_cast<const char *>(memmem(buffer, length, "\nwrite_bytes:", 13));
+	if (p != NULL)
+		ProcReader::parseNumber(p + 13, end, write_bytes);
 }
 
-ostream& operator<<(ostream &os, const Pid &p) {
-	os << p.mypid << " ";
-	if (p.kthread == true)
-		os << "[" << p.comm << "]";
-	else {
-		string buffer(p.cmdline);
-		replace(buffer.begin(), buffer.end(), '\0', ' ');
-		os << buffer;
+// comm is wrapped in parentheses and may itself contain spaces and
+// parentheses, so it ends at the last ')' in the line. The fields after it
+// are located in one pass and only the first stat_fields are parsed.
+bool Pid::parsestat(const char *data, size_t length) {
+	static const size_t stat_fields = 22;
+	const char *end = data + length;
+	const char *p = ProcReader::parseNumber(data, end, mypid);
+	if (p == NULL)
+		return false;
+
+	const char *open = static_cast<const char *>(memchr(p, '(', end - p));
+	const char *close = TextScan::findLast(p, end - p, ')');
+	if (open == NULL || close == NULL || close < open)
+		return false;
+	stat_comm.assign(open, close + 1);
+	p = close + 1;
+
+	const char *f[stat_fields];
+	if (TextScan::splitFields(p, end - p, f, stat_fields) < stat_fields)
+		return false;
+
+	if (ProcReader::parseChar(f[0], end, state) == NULL
+			|| ProcReader::parseNumber(f[1], end, ppid) == NULL
+			|| ProcReader::parseNumber(f[2], end, pgrp) == NULL
+			|| ProcReader::parseNumber(f[3], end, session) == NULL
+			|| ProcReader::parseNumber(f[4], end, tty_nr) == NULL
+			|| ProcReader::parseNumber(f[5], end, tpgid) == NULL
+			|| ProcReader::parseNumber(f[6], end, flags) == NULL
+			|| ProcReader::parseNumber(f[7], end, minflt) == NULL
+			|| ProcReader::parseNumber(f[8], end, cminflt) == NULL
+			|| ProcReader::parseNumber(f[9], end, majflt) == NULL
+			|| ProcReader::parseNumber(f[10], end, cmajflt) == NULL
+			|| ProcReader::parseNumber(f[11], end, utime) == NULL
+			|| ProcReader::parseNumber(f[12], end, stime) == NULL
+			|| ProcReader::parseNumber(f[13], end, cutime) == NULL
+			|| ProcReader::parseNumber(f[14], end, cstime) == NULL
+			|| ProcReader::parseNumber(f[15], end, priority) == NULL
+			|| ProcReader::parseNumber(f[16], end, nice) == NULL
+			|| ProcReader::parseNumber(f[17], end, num_threads) == NULL
+			|| ProcReader::parseNumber(f[18], end, itrealvalue) == NULL
+			|| ProcReader::parseNumber(f[19], end, starttime) == NULL
+			|| ProcReader::parseNumber(f[21], end, rss) == NULL) {
+		return false;
 	}
-	return os;
+	rss *= page_kb;
+
+	if (times) {
+		read_time = Clock::sinceBoot();
+		start_time = starttime * tick_ns;
+	}
+	return true;
+}
+
+Pid::~Pid() {
 }
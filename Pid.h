@@ -21,6 +21,7 @@
 #define PID_H_
 extern "C" {
 #include <stdint.h>
+#include <sys/types.h>
 }
 
 #include <string>
@@ -30,24 +31,40 @@ extern "C" {
 
 class Pid {
 public:
-	Pid(char number[]);
+	Pid(void);
+	Pid(const char number[]);
 	virtual ~Pid();
-	friend std::ostream& operator<<(std::ostream &os, const Pid &p);
+	bool read(const char number[]);
+	bool read(const char number[], char *cmdline, ssize_t cmdline_length,
+			const char *comm, ssize_t comm_length, const char *stat,
+			ssize_t stat_length);
+	bool valid(void) const;
+	bool update(void);
+	static void recordTimes(void);
 	friend int main(int argc, char *argv[]);
+	friend class PidSchema;
+	friend class PidTable;
+	friend class ProcEvents;
 private:
-	std::string mypid_s;
+	void reset(void);
+
+	// false if the process exited before /proc/#/stat could be read
+	bool found;
 	bool kthread;
 
 	// /proc/#/cmdline
-	void getcmdline(void);
+	void getcmdline(const char number[]);
+	void setcmdline(char *buffer, ssize_t length);
 	std::string cmdline;
 
 	// /proc/#/comm
-	void getcomm(void);
+	void getcomm(const char number[]);
+	void setcomm(const char *buffer, ssize_t length);
 	std::string comm;
 
 	// /proc/#/stat
-	void getstat(void);
+	void getstat(const char number[]);
+	bool parsestat(const char *data, size_t length);
 	pid_t mypid;
 	std::string stat_comm;
 	char state;
@@ -68,8 +85,37 @@ private:
 	long priority;
 	long nice;
 	long num_threads;
-};
+	long itrealvalue;
+	uint64_t starttime;
+	long rss;	// kB, stat holds pages
+	static long page_kb;
+
+	// From taskstats (--taskstats), zero without it: scheduling delays
+	// waiting for a CPU, block I/O and swap-in in ns, context switches,
+	// peak RSS in kB and bytes read and written by block I/O
+	void gettaskstats(const char number[]);
+	void getio(const char number[]);
+	uint64_t cpu_delay;
+	uint64_t blkio_delay;
+	uint64_t swapin_delay;
+	uint64_t nvcsw;
+	uint64_t nivcsw;
+	uint64_t hiwater_rss;
+	uint64_t read_bytes;
+	uint64_t write_bytes;
 
-std::ostream& operator<<(std::ostream &os, const Pid &p);
+	// With --read-times, when stat was read and when the process started
+	// (starttime) in ns of CLOCK_BOOTTIME, zero without it
+	static bool times;
+	static int64_t tick_ns;
+	int64_t read_time;
+	int64_t start_time;
+
+	// Filled in by Rates from the previous snapshot, -1 until there is one
+	int64_t utime_rate;
+	int64_t stime_rate;
+	int64_t minflt_rate;
+	int64_t majflt_rate;
+};
 
 #endif /* PID_H_ */
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+}
+
+#include "PidSchema.h"
+
+#define PID_NUMBER(name, type, member) \
+	{ name, type, \
+	  &PidNumber<decltype(&Pid::member), &Pid::member, type>::get, \
+	  &PidNumber<decltype(&Pid::member), &Pid::member, type>::set, \
+	  NULL, NULL }
+
+#define PID_TEXT(name, member) \
+	{ name, TEXTOID, NULL, NULL, &PidText<&Pid::member>::get, \
+	  &PidText<&Pid::member>::set }
+
+// Counters that can pass INT32_MAX are sent as int8; the server narrows
+// them to INTEGER columns and reports the ones that do not fit.
+const PidSchema::Column PidSchema::columns[] = {
+	PID_TEXT("cmdline", cmdline), // first, see PidSchema::cmdline
+	PID_NUMBER("pid", INT4OID, mypid),
+	PID_TEXT("comm", comm), // from /proc/#/comm
+	PID_NUMBER("state", CHAROID, state),
+	PID_NUMBER("ppid", INT4OID, ppid),
+	PID_NUMBER("pgrp", INT4OID, pgrp),
+	PID_NUMBER("session", INT4OID, session),
+	PID_NUMBER("tty_nr", INT4OID, tty_nr),
+	PID_NUMBER("tpgid", INT4OID, tpgid),
+	PID_NUMBER("flags", INT8OID, flags),
+	PID_NUMBER("minflt", INT8OID, minflt),
+	PID_NUMBER("cminflt", INT8OID, cminflt),
+	PID_NUMBER("majflt", INT8OID, majflt),
+	PID_NUMBER("cmajflt", INT8OID, cmajflt),
+	PID_NUMBER("utime", INT8OID, utime),
+	PID_NUMBER("stime", INT8OID, stime),
+	PID_NUMBER("cutime", INT8OID, cutime),
+	PID_NUMBER("priority", INT8OID, priority),
+	PID_NUMBER("nice", INT8OID, nice),
+	PID_NUMBER("num_threads", INT8OID, num_threads),
+	PID_NUMBER("starttime", INT8OID, starttime),
+	PID_NUMBER("rss", INT8OID, rss),
+	PID_NUMBER("cpu_delay", INT8OID, cpu_delay),
+	PID_NUMBER("blkio_delay", INT8OID, blkio_delay),
+	PID_NUMBER("swapin_delay", INT8OID, swapin_delay),
+	PID_NUMBER("nvcsw", INT8OID, nvcsw),
+	PID_NUMBER("nivcsw", INT8OID, nivcsw),
+	PID_NUMBER("hiwater_rss", INT8OID, hiwater_rss),
+	PID_NUMBER("read_bytes", INT8OID, read_bytes),
+	PID_NUMBER("write_bytes", INT8OID, write_bytes),
+	PID_NUMBER("read_time", INT8OID, read_time),
+	PID_NUMBER("start_time", INT8OID, start_time),
+	PID_NUMBER("utime_rate", INT8OID, utime_rate),
+	PID_NUMBER("stime_rate", INT8OID, stime_rate),
+	PID_NUMBER("minflt_rate", INT8OID, minflt_rate),
+	PID_NUMBER("majflt_rate", INT8OID, majflt_rate),
+};
+
+#undef PID_NUMBER
+#undef PID_TEXT
+
+const size_t PidSchema::count = sizeof(columns) / sizeof(columns[0]);
+
+static size_t find(const char *name) {
+	for (size_t i = 0; i < PidSchema::count; ++i) {
+		if (strcmp(PidSchema::columns[i].name, name) == 0)
+			return i;
+	}
+	abort();
+}
+
+const size_t PidSchema::pid = find("pid");
+const size_t PidSchema::starttime = find("starttime");
+const size_t PidSchema::comm = find("comm");
+const size_t PidSchema::read_time = find("read_time");
+const size_t PidSchema::utime = find("utime");
+const size_t PidSchema::stime = find("stime");
+const size_t PidSchema::minflt = find("minflt");
+const size_t PidSchema::majflt = find("majflt");
+const size_t PidSchema::utime_rate = find("utime_rate");
+const size_t PidSchema::stime_rate = find("stime_rate");
+const size_t PidSchema::minflt_rate = find("minflt_rate");
+const size_t PidSchema::majflt_rate = find("majflt_rate");
+const size_t PidSchema::state = find("state");
+const size_t PidSchema::rss = find("rss");
+
+void PidSchema::declare(Copy &c, size_t first) {
+	for (size_t i = first; i < count; ++i)
+		c.addCol(columns[i].name);
+}
+
+void PidSchema::declare(Prepare &s, size_t first) {
+	for (size_t i = first; i < count; ++i)
+		s.declareCol(columns[i].name, columns[i].type);
+}
+
+// Append one encoded process to t. On a short or damaged record the row
+// may be left incomplete and false is returned.
+bool PidSchema::decode(SnapshotReader &r, PidTable &t) {
+	for (size_t i = 0; i < count; ++i) {
+		switch (columns[i].type) {
+		case TEXTOID: {
+			const char *text;
+			size_t length;
+			r.get(text, length);
+			t.addText(i, text, length);
+			break;
+		}
+		case INT4OID: {
+			int32_t value;
+			r.get(value);
+			t.addNumber(i, value);
+			break;
+		}
+		case CHAROID: {
+			char value;
+			r.get(value);
+			t.addNumber(i, value);
+			break;
+		}
+		default: {
+			int64_t value;
+			r.get(value);
+			t.addNumber(i, value);
+			break;
+		}
+		}
+	}
+	t.endRow();
+	return r.ok();
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef PIDSCHEMA_H_
+#define PIDSCHEMA_H_
+
+extern "C" {
+#include <stddef.h>
+}
+
+#include "Pid.h"
+#include "PidTable.h"
+#include "Pgsql.h"
+#include "Snapshot.h"
+
+// C++ type a value is converted to before it is handed to a writer, which
+// picks the binary encoding from it
+template<Oid type> struct PgType;
+template<> struct PgType<INT4OID> {
+	typedef int32_t type;
+};
+template<> struct PgType<INT8OID> {
+	typedef int64_t type;
+};
+template<> struct PgType<CHAROID> {
+	typedef char type;
+};
+
+// Moves one Pid member into a PidTable column and back. Numbers are held
+// as int64 after the conversion to the column's type; text is copied
+// into the table's arena.
+template<typename Member, Member member, Oid type>
+struct PidNumber {
+	static int64_t get(const Pid &p) {
+		return static_cast<typename PgType<type>::type>(p.*member);
+	}
+
+	static void set(Pid &p, int64_t value) {
+		p.*member = static_cast<typename PgType<type>::type>(value);
+	}
+};
+
+template<string Pid::*member>
+struct PidText {
+	static const string &get(const Pid &p) {
+		return p.*member;
+	}
+
+	static void set(Pid &p, const char *data, size_t length) {
+		(p.*member).assign(data, length);
+	}
+};
+
+// The columns of a pids row that come from a Pid. The table in
+// PidSchema.cpp is the only place a column is declared: the insert SQL,
+// the COPY column list, the PidTable columns and the per-row encoders are
+// all generated from it. set_id, and change for pid_deltas, are added
+// around these by the caller.
+class PidSchema {
+public:
+	struct Column {
+		const char *name;
+		Oid type;
+		// Set for number columns
+		int64_t (*getNumber)(const Pid &p);
+		void (*setNumber)(Pid &p, int64_t value);
+		// Set for TEXTOID columns
+		const string &(*getText)(const Pid &p);
+		void (*setText)(Pid &p, const char *data, size_t length);
+	};
+
+	static const Column columns[];
+	static const size_t count;
+
+	// cmdline is the first column; with --cmdlines the writer sends a
+	// cmdline_id in its place and the row goes on from here
+	static const size_t cmdline = 0;
+	static const size_t after_cmdline = cmdline + 1;
+	// What Delta matches processes on
+	static const size_t pid;
+	static const size_t starttime;
+	static const size_t comm;
+	// What PidTable::differs() leaves out
+	static const size_t read_time;
+	// What Rates reads and fills in
+	static const size_t utime;
+	static const size_t stime;
+	static const size_t minflt;
+	static const size_t majflt;
+	static const size_t utime_rate;
+	static const size_t stime_rate;
+	static const size_t minflt_rate;
+	static const size_t majflt_rate;
+	// What Filter ranks and fills in
+	static const size_t state;
+	static const size_t rss;
+
+	static void declare(Copy &c, size_t first = 0);
+	static void declare(Prepare &s, size_t first = 0);
+
+	// Row row of t, to a Copy, a Prepare or a SnapshotWriter
+	template<class Writer>
+	static void write(Writer &w, const PidTable &t, size_t row,
+			size_t first = 0) {
+		for (size_t i = first; i < count; ++i) {
+			switch (columns[i].type) {
+			case TEXTOID: {
+				size_t length;
+				const char *text = t.text(i, row, length);
+				w.add(text, length);
+				break;
+			}
+			case INT4OID:
+				w.add(int32_t(t.number(i, row)));
+				break;
+			case CHAROID:
+				w.add(char(t.number(i, row)));
+				break;
+			default:
+				w.add(int64_t(t.number(i, row)));
+				break;
+			}
+		}
+	}
+
+	static bool decode(SnapshotReader &r, PidTable &t);
+};
+
+#endif /* PIDSCHEMA_H_ */
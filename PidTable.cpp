@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <string.h>
+}
+
+#include <utility>
+#include "PidTable.h"
+#include "PidSchema.h"
+
+PidTable::PidTable() :
+		rows(0), numbers(PidSchema::count), texts(PidSchema::count) {
+}
+
+void PidTable::clear(void) {
+	rows = 0;
+	for (size_t i = 0; i < PidSchema::count; ++i) {
+		numbers[i].clear();
+		texts[i].clear();
+	}
+	arena.clear();
+}
+
+size_t PidTable::size(void) const {
+	return rows;
+}
+
+bool PidTable::empty(void) const {
+	return rows == 0;
+}
+
+void PidTable::addNumber(size_t column, int64_t value) {
+	numbers[column].push_back(value);
+}
+
+void PidTable::addText(size_t column, const char *data, size_t length) {
+	Text t;
+	t.offset = arena.size();
+	t.length = length;
+	arena.insert(arena.end(), data, data + length);
+	texts[column].push_back(t);
+}
+
+void PidTable::endRow(void) {
+	++rows;
+}
+
+void PidTable::append(const Pid &p) {
+	for (size_t i = 0; i < PidSchema::count; ++i) {
+		const PidSchema::Column &c = PidSchema::columns[i];
+		if (c.type == TEXTOID) {
+			const string &s = c.getText(p);
+			addText(i, s.data(), s.size());
+		} else {
+			addNumber(i, c.getNumber(p));
+		}
+	}
+	endRow();
+}
+
+void PidTable::append(const PidTable &t, size_t row) {
+	for (size_t i = 0; i < PidSchema::count; ++i) {
+		if (PidSchema::columns[i].type == TEXTOID) {
+			size_t length;
+			const char *data = t.text(i, row, length);
+			addText(i, data, length);
+		} else {
+			addNumber(i, t.numbers[i][row]);
+		}
+	}
+	endRow();
+}
+
+// Column by column, the arena in one piece
+void PidTable::append(const PidTable &t) {
+	uint32_t base = arena.size();
+	arena.insert(arena.end(), t.arena.begin(), t.arena.end());
+	for (size_t i = 0; i < PidSchema::count; ++i) {
+		if (PidSchema::columns[i].type == TEXTOID) {
+			size_t first = texts[i].size();
+			texts[i].insert(texts[i].end(), t.texts[i].begin(),
+					t.texts[i].end());
+			for (size_t j = first; j < texts[i].size(); ++j) {
+				texts[i][j].offset += base;
+			}
+		} else {
+			numbers[i].insert(numbers[i].end(), t.numbers[i].begin(),
+					t.numbers[i].end());
+		}
+	}
+	rows += t.rows;
+}
+
+void PidTable::swap(PidTable &t) {
+	std::swap(rows, t.rows);
+	numbers.swap(t.numbers);
+	texts.swap(t.texts);
+	arena.swap(t.arena);
+}
+
+// Fill p with the stored columns of row; what is not stored, such as
+// itrealvalue, is left as it was
+void PidTable::get(size_t row, Pid &p) const {
+	for (size_t i = 0; i < PidSchema::count; ++i) {
+		const PidSchema::Column &c = PidSchema::columns[i];
+		if (c.type == TEXTOID) {
+			size_t length;
+			const char *data = text(i, row, length);
+			c.setText(p, data, length);
+		} else {
+			c.setNumber(p, numbers[i][row]);
+		}
+	}
+	p.found = true;
+	p.kthread = p.cmdline.empty();
+}
+
+// True if any stored value differs between row and row other of t
+// other than read_time, which moves on every set
+bool PidTable::differs(size_t row, const PidTable &t, size_t other) const {
+	for (size_t i = 0; i < PidSchema::count; ++i) {
+		if (i == PidSchema::read_time) {
+			continue;
+		} else if (PidSchema::columns[i].type == TEXTOID) {
+			const Text &a = texts[i][row];
+			const Text &b = t.texts[i][other];
+			if (a.length != b.length
+					|| memcmp(arena.data() + a.offset,
+							t.arena.data() + b.offset, a.length) != 0)
+				return true;
+		} else if (numbers[i][row] != t.numbers[i][other]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+pid_t PidTable::pid(size_t row) const {
+	return numbers[PidSchema::pid][row];
+}
+
+uint64_t PidTable::starttime(size_t row) const {
+	return numbers[PidSchema::starttime][row];
+}
+
+ostream &operator<<(ostream &os, const PidTable &t) {
+	for (size_t row = 0; row < t.size(); ++row) {
+		size_t length;
+		const char *cmdline = t.text(PidSchema::cmdline, row, length);
+		os << t.pid(row) << " ";
+		if (length == 0) {
+			cmdline = t.text(PidSchema::comm, row, length);
+			os << "[";
+			os.write(cmdline, length);
+			os << "]";
+		} else {
+			os.write(cmdline, length);
+		}
+		os << "\n";
+	}
+	return os;
+}
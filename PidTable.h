@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef PIDTABLE_H_
+#define PIDTABLE_H_
+
+extern "C" {
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+}
+
+#include <vector>
+#include <ostream>
+
+#include "Pid.h"
+
+using namespace std;
+
+// The processes of one snapshot, column by column in the order of
+// PidSchema::columns. Each number column is an array of int64, and every
+// string of the snapshot is in one arena that text columns point into.
+// clear() keeps the capacity of all of them, so a table that is refilled
+// every cycle stops allocating once it has seen its largest snapshot.
+class PidTable {
+private:
+	struct Text {
+		uint32_t offset;
+		uint32_t length;
+	};
+
+	size_t rows;
+	vector<vector<int64_t> > numbers;
+	vector<vector<Text> > texts;
+	vector<char> arena;
+
+	friend class PidSchema;
+	friend class Rates;
+	friend class Filter;
+	void addNumber(size_t column, int64_t value);
+	void addText(size_t column, const char *data, size_t length);
+	void endRow(void);
+
+public:
+	PidTable();
+	void clear(void);
+	size_t size(void) const;
+	bool empty(void) const;
+	void append(const Pid &p);
+	void append(const PidTable &t, size_t row);
+	void append(const PidTable &t);
+	void swap(PidTable &t);
+	void get(size_t row, Pid &p) const;
+	bool differs(size_t row, const PidTable &t, size_t other) const;
+
+	int64_t number(size_t column, size_t row) const {
+		return numbers[column][row];
+	}
+
+	const char *text(size_t column, size_t row, size_t &length) const {
+		const Text &t = texts[column][row];
+		length = t.length;
+		return arena.data() + t.offset;
+	}
+
+	pid_t pid(size_t row) const;
+	uint64_t starttime(size_t row) const;
+};
+
+// One line per process: the PID and its command line, or [comm] for
+// kernel threads
+ostream &operator<<(ostream &os, const PidTable &t);
+
+#endif /* PIDTABLE_H_ */
@@ -0,0 +1,321 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+}
+
+#include <algorithm>
+#include "ProcEvents.h"
+#include "Metrics.h"
+
+// Room for the events of a fork storm between two reads
+static const int events_rcvbuf = 4 << 20;
+
+ProcEvents::ProcEvents(Scanner &scanner, unsigned reconcile_interval) :
+		sock(-1), stopping(false), lost(true), scanner(scanner),
+		reconcile_interval(reconcile_interval), since_reconcile(0) {
+}
+
+ProcEvents::~ProcEvents() {
+	stopping = true;
+	if (reader.joinable())
+		reader.join();
+	if (sock != -1) {
+		subscribe(false);
+		close(sock);
+	}
+}
+
+bool ProcEvents::subscribe(bool listen) {
+	// nlmsghdr, cn_msg and the operation, back to back
+	char request[NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))];
+	memset(request, 0, sizeof(request));
+	struct nlmsghdr *header = reinterpret_cast<struct nlmsghdr *>(request);
+	header->nlmsg_len = sizeof(request);
+	header->nlmsg_type = NLMSG_DONE;
+	struct cn_msg *message = static_cast<struct cn_msg *>(NLMSG_DATA(header));
+	message->id.idx = CN_IDX_PROC;
+	message->id.val = CN_VAL_PROC;
+	message->len = sizeof(enum proc_cn_mcast_op);
+	enum proc_cn_mcast_op op = listen ? PROC_CN_MCAST_LISTEN : PROC_CN_MCAST_IGNORE;
+	memcpy(message->data, &op, sizeof(op));
+
+	if (send(sock, &request, sizeof(request), 0) == -1) {
+		perror("proc connector");
+		return false;
+	}
+	return true;
+}
+
+bool ProcEvents::open(void) {
+	sock = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if (sock == -1) {
+		perror("proc connector");
+		return false;
+	}
+
+	struct sockaddr_nl address;
+	memset(&address, 0, sizeof(address));
+	address.nl_family = AF_NETLINK;
+	address.nl_groups = CN_IDX_PROC;
+	if (bind(sock, reinterpret_cast<struct sockaddr *>(&address),
+			sizeof(address)) == -1) {
+		perror("proc connector");
+		close(sock);
+		sock = -1;
+		return false;
+	}
+
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &events_rcvbuf,
+			sizeof(events_rcvbuf)) == -1)
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &events_rcvbuf,
+				sizeof(events_rcvbuf));
+
+	if (subscribe(true) == false) {
+		close(sock);
+		sock = -1;
+		return false;
+	}
+
+	reader = thread(&ProcEvents::read, this);
+	return true;
+}
+
+void ProcEvents::read(void) {
+	// Stop signals are for the sampling loop
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	char buffer[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	char number[16];
+	while (stopping == false) {
+		struct pollfd pfd;
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 500) <= 0)
+			continue;
+
+		ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+		if (n == -1) {
+			if (errno == ENOBUFS) {
+				// The kernel dropped events, only a full scan is right now
+				lock_guard<mutex> guard(lock);
+				lost = true;
+			} else if (errno != EINTR && errno != EAGAIN) {
+				perror("proc connector");
+				lock_guard<mutex> guard(lock);
+				lost = true;
+				return;
+			}
+			continue;
+		}
+
+		int length = n;
+		for (struct nlmsghdr *h = reinterpret_cast<struct nlmsghdr *>(buffer);
+				NLMSG_OK(h, length); h = NLMSG_NEXT(h, length)) {
+			if (h->nlmsg_type == NLMSG_ERROR || h->nlmsg_type == NLMSG_NOOP)
+				continue;
+			struct cn_msg *message = static_cast<struct cn_msg *>(NLMSG_DATA(h));
+			if (message->id.idx != CN_IDX_PROC || message->id.val != CN_VAL_PROC)
+				continue;
+			struct proc_event *event =
+					reinterpret_cast<struct proc_event *>(message->data);
+
+			// Threads have their own events, only thread group leaders are
+			// processes
+			switch (event->what) {
+			case proc_event::PROC_EVENT_FORK: {
+				pid_t child = event->event_data.fork.child_pid;
+				if (child != event->event_data.fork.child_tgid)
+					break;
+				// Read at the next set, until an exec it runs its parent's
+				// command line
+				Pid p;
+				p.mypid = child;
+				lock_guard<mutex> guard(lock);
+				started.insert(make_pair(child, p));
+				break;
+			}
+			case proc_event::PROC_EVENT_EXEC: {
+				pid_t pid = event->event_data.exec.process_pid;
+				if (pid != event->event_data.exec.process_tgid)
+					break;
+				snprintf(number, sizeof(number), "%d", pid);
+				Pid p(number);
+				lock_guard<mutex> guard(lock);
+				started[pid] = p;
+				break;
+			}
+			case proc_event::PROC_EVENT_EXIT: {
+				pid_t pid = event->event_data.exit.process_pid;
+				if (pid != event->event_data.exit.process_tgid)
+					break;
+				// Until its parent reaps it the process is a zombie whose stat
+				// has the final times, but its cmdline is already gone
+				snprintf(number, sizeof(number), "%d", pid);
+				Pid p(number);
+				lock_guard<mutex> guard(lock);
+				map<pid_t, Pid>::iterator s = started.find(pid);
+				if (s != started.end()) {
+					if (s->second.valid() && p.cmdline.empty()
+							&& (p.valid() == false
+									|| p.starttime == s->second.starttime)) {
+						p.cmdline = s->second.cmdline;
+						p.comm = s->second.comm;
+						p.kthread = s->second.kthread;
+					}
+					started.erase(s);
+				}
+				exited.push_back(p);
+				break;
+			}
+			default:
+				break;
+			}
+		}
+	}
+}
+
+void ProcEvents::scan(PidTable &pids) {
+	map<pid_t, Pid> born;
+	vector<Pid> gone;
+	bool rescan;
+	{
+		lock_guard<mutex> guard(lock);
+		born.swap(started);
+		gone.swap(exited);
+		rescan = lost;
+		lost = false;
+	}
+
+	// Processes that exited since the last set, with their final times, or
+	// the last ones seen if they were reaped before they could be read
+	vector<Pid> finals;
+	for (vector<Pid>::iterator e = gone.begin(); e != gone.end(); ++e) {
+		map<pid_t, Pid>::iterator t = table.find(e->mypid);
+		bool known = t != table.end()
+				&& (e->valid() == false || t->second.starttime == e->starttime);
+		if (e->valid()) {
+			if (known && e->cmdline.empty()) {
+				e->cmdline = t->second.cmdline;
+				e->comm = t->second.comm;
+				e->kthread = t->second.kthread;
+			}
+			finals.push_back(*e);
+		} else if (known) {
+			finals.push_back(t->second);
+		}
+		if (known)
+			table.erase(t);
+	}
+
+	// A child that exited without an exec ran its parent's command line; the
+	// parent may be short lived too
+	map<pid_t, const Pid *> parents;
+	for (vector<Pid>::iterator f = finals.begin(); f != finals.end(); ++f)
+		parents[f->mypid] = &*f;
+	for (vector<Pid>::iterator f = finals.begin(); f != finals.end(); ++f) {
+		const Pid *source = &*f;
+		for (int hops = 0; source->cmdline.empty() && source->ppid > 2
+				&& hops < 8; ++hops) {
+			map<pid_t, Pid>::iterator t = table.find(source->ppid);
+			map<pid_t, const Pid *>::iterator p = parents.find(source->ppid);
+			if (t != table.end())
+				source = &t->second;
+			else if (p != parents.end())
+				source = p->second;
+			else
+				break;
+		}
+		if (source != &*f && source->cmdline.empty() == false) {
+			f->cmdline = source->cmdline;
+			f->comm.clear();
+			f->kthread = false;
+		}
+	}
+
+	if (rescan || ++since_reconcile >= reconcile_interval) {
+		scanner.scan(pids);
+		table.clear();
+		for (size_t row = 0; row < pids.size(); ++row)
+			pids.get(row, table[pids.pid(row)]);
+		since_reconcile = 0;
+	} else {
+		char number[16];
+		for (map<pid_t, Pid>::iterator b = born.begin(); b != born.end(); ++b) {
+			if (b->second.valid()) {
+				table[b->first] = b->second;
+				continue;
+			}
+			snprintf(number, sizeof(number), "%d", b->first);
+			Pid p(number);
+			if (p.valid())
+				table[b->first] = p;
+		}
+
+		for (map<pid_t, Pid>::iterator t = table.begin(); t != table.end();) {
+			uint64_t start = Metrics::now();
+			bool running = t->second.update();
+			Metrics::record(Metrics::PARSE, Metrics::now() - start);
+			if (running) {
+				++t;
+			} else {
+				table.erase(t++);
+			}
+		}
+	}
+
+	// The table is in PID order; a zombie that is still listed is not
+	// added twice
+	vector<const Pid *> listed;
+	listed.reserve(table.size() + finals.size());
+	for (map<pid_t, Pid>::iterator t = table.begin(); t != table.end(); ++t)
+		listed.push_back(&t->second);
+	size_t tracked = listed.size();
+	for (vector<Pid>::iterator f = finals.begin(); f != finals.end(); ++f) {
+		map<pid_t, Pid>::iterator t = table.find(f->mypid);
+		if (t == table.end() || t->second.starttime != f->starttime)
+			listed.push_back(&*f);
+	}
+	if (listed.size() != tracked) {
+		sort(listed.begin(), listed.end(), [](const Pid *a, const Pid *b) {
+			return a->mypid != b->mypid ?
+					a->mypid < b->mypid : a->starttime < b->starttime;
+		});
+	}
+
+	pids.clear();
+	for (vector<const Pid *>::iterator i = listed.begin(); i != listed.end();
+			++i)
+		pids.append(**i);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef PROCEVENTS_H_
+#define PROCEVENTS_H_
+
+extern "C" {
+#include <sys/types.h>
+}
+
+#include <map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#include "Pid.h"
+#include "PidTable.h"
+#include "Scanner.h"
+
+using namespace std;
+
+// Keeps a process table up to date from the kernel's proc connector
+// (NETLINK_CONNECTOR, CN_IDX_PROC) instead of listing /proc for every set.
+// A thread takes the fork, exec and exit events as they come. Exec'd
+// processes are read right away, exited ones once more for their final
+// times, so a process shorter than the interval still shows up in the next
+// set. At a snapshot only the processes already in the table have their
+// stat read again; cmdline and comm are read for new ones only. Every
+// reconcile_interval sets, and whenever the kernel dropped events, the
+// table is rebuilt from a full scan. Subscribing needs CAP_NET_ADMIN.
+class ProcEvents {
+private:
+	int sock;
+	thread reader;
+	mutex lock;
+	atomic<bool> stopping;
+
+	// Filled by the reader and taken by scan()
+	map<pid_t, Pid> started;
+	vector<Pid> exited;
+	bool lost;
+
+	Scanner &scanner;
+	unsigned reconcile_interval;
+	unsigned since_reconcile;
+	map<pid_t, Pid> table;
+
+	bool subscribe(bool listen);
+	void read(void);
+
+public:
+	ProcEvents(Scanner &scanner, unsigned reconcile_interval);
+	virtual ~ProcEvents();
+	bool open(void);
+	void scan(PidTable &pids);
+};
+
+#endif /* PROCEVENTS_H_ */
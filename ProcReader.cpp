@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+}
+
+#include "ProcReader.h"
+
+using namespace std;
+
+int ProcReader::rootfd = -1;
+thread_local vector<char> ProcReader::buffer(4096);
+
+// Must be called before any reader threads are started
+bool ProcReader::open(const char *root) {
+	int fd = ::open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		perror(root);
+		return false;
+	}
+
+	close();
+	rootfd = fd;
+	return true;
+}
+
+void ProcReader::close(void) {
+	if (rootfd != -1) {
+		::close(rootfd);
+		rootfd = -1;
+	}
+}
+
+int ProcReader::getRootFd(void) {
+	if (rootfd == -1) {
+		open();
+	}
+	return rootfd;
+}
+
+// Read all of <pid>/<file> into this thread's buffer. data points at the
+// contents, which stay valid until the thread's next read(). Returns the
+// length, or -1 if the file could not be read (usually the process exited).
+ssize_t ProcReader::read(const char *pid, const char *file, char *&data) {
+	char path[64];
+	size_t len = 0;
+
+	while (*pid != '\0' && len < 24)
+		path[len++] = *pid++;
+	path[len++] = '/';
+	while (*file != '\0' && len < sizeof(path) - 1)
+		path[len++] = *file++;
+	path[len] = '\0';
+
+	int fd = openat(getRootFd(), path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+
+	size_t total = 0;
+	for (;;) {
+		// Keep a spare byte so callers can terminate the contents
+		if (buffer.size() - total < 2) {
+			buffer.resize(buffer.size() * 2);
+		}
+
+		ssize_t n = ::read(fd, &buffer[total], buffer.size() - total - 1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			::close(fd);
+			return -1;
+		}
+		if (n == 0)
+			break;
+		total += n;
+	}
+
+	::close(fd);
+	buffer[total] = '\0';
+	data = &buffer[0];
+	return total;
+}
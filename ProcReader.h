@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef PROCREADER_H_
+#define PROCREADER_H_
+
+extern "C" {
+#include <stddef.h>
+#include <sys/types.h>
+}
+
+#include <vector>
+
+// Reads /proc/<pid>/<file> with openat() relative to a cached descriptor
+// of the proc root and read() into a buffer owned by the calling thread,
+// so reading a process costs no path building, streams or heap traffic.
+class ProcReader {
+private:
+	static int rootfd;
+	static thread_local std::vector<char> buffer;
+
+public:
+	static bool open(const char *root = "/proc");
+	static void close(void);
+	static int getRootFd(void);
+	static ssize_t read(const char *pid, const char *file, char *&data);
+
+	// Number parsing for space separated procfs fields. Each returns the
+	// position after the number, or NULL if no number was found.
+	template<typename T>
+	static const char *parseNumber(const char *p, const char *end, T &value) {
+		while (p < end && *p == ' ')
+			++p;
+
+		bool negative = false;
+		if (p < end && *p == '-') {
+			negative = true;
+			++p;
+		}
+
+		if (p >= end || *p < '0' || *p > '9')
+			return NULL;
+
+		T n = 0;
+		while (p < end && *p >= '0' && *p <= '9') {
+			n = n * 10 + (*p - '0');
+			++p;
+		}
+
+		value = negative ? 0 - n : n;
+		return p;
+	}
+
+	static const char *parseChar(const char *p, const char *end, char &value) {
+		while (p < end && *p == ' ')
+			++p;
+
+		if (p >= end)
+			return NULL;
+
+		value = *p;
+		return p + 1;
+	}
+};
+
+#endif /* PROCREADER_H_ */
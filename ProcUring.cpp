@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+}
+
+#include <iostream>
+#include "ProcUring.h"
+#include "ProcReader.h"
+
+// Contents up to this size are read in the batch; larger files, mostly
+// long command lines, are read again with ProcReader
+static const size_t slot_size = 4096;
+static const size_t path_size = 64;
+
+bool ProcUring::enabled = false;
+
+ProcUring::ProcUring(unsigned entries) :
+		ring(-1), broken(false), sq_map(MAP_FAILED), cq_map(MAP_FAILED),
+		sq_size(0), cq_size(0), sqes(NULL), sqes_size(0), sq_entries(0),
+		sq_head(NULL), sq_tail(NULL), sq_mask(NULL), cq_head(NULL),
+		cq_tail(NULL), cq_mask(NULL), cqes(NULL), queued(0), pending(0),
+		count(0) {
+	if (enabled && setup(entries) == false)
+		teardown();
+}
+
+ProcUring::~ProcUring() {
+	teardown();
+}
+
+bool ProcUring::setup(unsigned entries) {
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring == -1)
+		return false;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		sq_size = cq_size = max(sq_size, cq_size);
+	}
+
+	sq_map = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+	if (sq_map == MAP_FAILED)
+		return false;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_map = sq_map;
+	} else {
+		cq_map = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+		if (cq_map == MAP_FAILED)
+			return false;
+	}
+	sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+	void *m = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+	if (m == MAP_FAILED)
+		return false;
+	sqes = static_cast<io_uring_sqe *>(m);
+
+	char *sq = static_cast<char *>(sq_map);
+	char *cq = static_cast<char *>(cq_map);
+	sq_entries = p.sq_entries;
+	sq_head = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+	sq_mask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+	cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+	cq_mask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+	cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+
+	// Entries are always used in ring order
+	unsigned *array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+	for (unsigned i = 0; i < sq_entries; ++i)
+		array[i] = i;
+
+	return supports();
+}
+
+void ProcUring::teardown(void) {
+	if (sqes != NULL)
+		munmap(sqes, sqes_size);
+	if (cq_map != MAP_FAILED && cq_map != sq_map)
+		munmap(cq_map, cq_size);
+	if (sq_map != MAP_FAILED)
+		munmap(sq_map, sq_size);
+	if (ring != -1)
+		close(ring);
+	sqes = NULL;
+	sq_map = cq_map = MAP_FAILED;
+	ring = -1;
+}
+
+// openat, read and close were added as ring operations in 5.6, and a
+// kernel or seccomp filter may refuse them even where the ring is allowed
+bool ProcUring::supports(void) {
+	static const unsigned ops = 256;
+	size_t size = sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op);
+	io_uring_probe *probe = static_cast<io_uring_probe *>(calloc(1, size));
+	if (probe == NULL)
+		return false;
+
+	bool ok = syscall(__NR_io_uring_register, ring, IORING_REGISTER_PROBE,
+			probe, ops) == 0;
+	const int needed[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+	for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); ++i) {
+		ok = needed[i] <= probe->last_op
+				&& (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+	}
+	free(probe);
+	return ok;
+}
+
+// Set up and probe a ring once, after enable()
+bool ProcUring::available(void) {
+	if (enabled == false)
+		return false;
+	static bool usable = ProcUring(8).ready();
+	return usable;
+}
+
+// Must be called before any ProcUring is made
+void ProcUring::enable(void) {
+	enabled = true;
+}
+
+bool ProcUring::ready(void) const {
+	return ring != -1 && broken == false;
+}
+
+void ProcUring::fail(const char *what) {
+	perror(what);
+	cerr << "Reading /proc without io_uring from now on" << endl;
+	broken = true;
+}
+
+// A free entry for the caller to fill in, with room for needed - 1 more
+// after it. Everything in flight is completed first if the ring is full.
+io_uring_sqe *ProcUring::reserve(unsigned needed) {
+	unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if (*sq_tail - head + needed > sq_entries && submit() == false)
+		return NULL;
+
+	io_uring_sqe *sqe = &sqes[*sq_tail & *sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+void ProcUring::queue(io_uring_sqe *sqe, Kind kind, size_t index) {
+	sqe->user_data = index << 2 | kind;
+	__atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+	++queued;
+}
+
+// Submit what is queued and wait until everything in flight completed
+bool ProcUring::submit(void) {
+	while (queued > 0 || pending > 0) {
+		int n = syscall(__NR_io_uring_enter, ring, queued, queued + pending,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n == -1) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+				reap();
+				continue;
+			}
+			fail("io_uring_enter");
+			return false;
+		}
+		queued -= n;
+		pending += n;
+		reap();
+	}
+	return true;
+}
+
+void ProcUring::reap(void) {
+	unsigned head = *cq_head;
+	unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head) {
+		const io_uring_cqe &cqe = cqes[head & *cq_mask];
+		size_t index = cqe.user_data >> 2;
+		switch (Kind(cqe.user_data & 3)) {
+		case OPEN:
+			fds[index] = cqe.res;
+			break;
+		case READ:
+			files[index].length = cqe.res < 0 ? -1 : cqe.res;
+			break;
+		case CLOSE:
+			fds[index] = -1;
+			break;
+		}
+		--pending;
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Read names[0] to names[count - 1] of each of the n pids. False if the
+// ring failed, in which case nothing was read and ready() is false.
+bool ProcUring::read(const char *const pids[], size_t n,
+		const char *const names[], size_t count) {
+	if (ready() == false)
+		return false;
+
+	size_t total = n * count;
+	this->count = count;
+	paths.resize(total * path_size);
+	buffers.resize(total * slot_size);
+	fds.assign(total, -1);
+	files.resize(total);
+
+	for (size_t i = 0; i < total; ++i) {
+		char *path = &paths[i * path_size];
+		snprintf(path, path_size, "%s/%s", pids[i / count], names[i % count]);
+		files[i].data = &buffers[i * slot_size];
+		files[i].data[0] = '\0';
+		files[i].length = -1;
+
+		io_uring_sqe *sqe = reserve(1);
+		if (sqe == NULL)
+			break;
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = ProcReader::getRootFd();
+		sqe->addr = reinterpret_cast<uintptr_t>(path);
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		queue(sqe, OPEN, i);
+	}
+	submit();
+
+	// The close is hard linked to the read so it runs after it, whether
+	// the read succeeded or not; a pair is never split across submissions
+	for (size_t i = 0; ready() && i < total; ++i) {
+		if (fds[i] < 0)
+			continue;
+
+		io_uring_sqe *sqe = reserve(2);
+		if (sqe == NULL)
+			break;
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fds[i];
+		sqe->addr = reinterpret_cast<uintptr_t>(files[i].data);
+		sqe->len = slot_size - 1;
+		sqe->flags = IOSQE_IO_HARDLINK;
+		queue(sqe, READ, i);
+
+		sqe = &sqes[*sq_tail & *sq_mask];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = fds[i];
+		queue(sqe, CLOSE, i);
+	}
+	submit();
+
+	if (ready() == false) {
+		for (size_t i = 0; i < total; ++i) {
+			if (fds[i] >= 0)
+				close(fds[i]);
+		}
+		return false;
+	}
+
+	// A full slot means there is more: read the whole file again
+	size_t more = 0;
+	for (size_t i = 0; i < total; ++i)
+		more += files[i].length == ssize_t(slot_size - 1);
+	if (large.size() < more)
+		large.resize(more);
+	for (size_t i = 0, k = 0; i < total; ++i) {
+		File &f = files[i];
+		if (f.length >= 0)
+			f.data[f.length] = '\0';
+		if (f.length != ssize_t(slot_size - 1))
+			continue;
+
+		char *data;
+		f.length = ProcReader::read(pids[i / count], names[i % count], data);
+		if (f.length >= 0) {
+			large[k].assign(data, data + f.length + 1);
+			f.data = &large[k++][0];
+		}
+	}
+	return true;
+}
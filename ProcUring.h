@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef PROCURING_H_
+#define PROCURING_H_
+
+extern "C" {
+#include <stddef.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+}
+
+#include <vector>
+
+using namespace std;
+
+// Reads the same few /proc files of a batch of PIDs through an io_uring:
+// one submission opens all of them and a second reads and closes them, so
+// a batch costs a handful of system calls instead of three per file. The
+// ring is set up with raw system calls. Each ProcUring is used by one
+// thread at a time. Rings are only made after enable() (--io-uring);
+// available() tells whether the kernel allows them, and callers read the
+// files one by one with ProcReader when it does not.
+class ProcUring {
+public:
+	// The contents of one file, writable and NUL terminated. length is -1
+	// if it could not be opened or read.
+	struct File {
+		char *data;
+		ssize_t length;
+	};
+
+private:
+	enum Kind {
+		OPEN, READ, CLOSE
+	};
+
+	int ring;
+	bool broken;
+	void *sq_map;
+	void *cq_map;
+	size_t sq_size;
+	size_t cq_size;
+	io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned sq_entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	io_uring_cqe *cqes;
+	unsigned queued;
+	unsigned pending;
+
+	size_t count;
+	vector<char> paths;
+	vector<char> buffers;
+	vector<int> fds;
+	vector<File> files;
+	vector<vector<char> > large;
+
+	static bool enabled;
+	bool setup(unsigned entries);
+	void teardown(void);
+	bool supports(void);
+	io_uring_sqe *reserve(unsigned needed);
+	void queue(io_uring_sqe *sqe, Kind kind, size_t index);
+	bool submit(void);
+	void reap(void);
+	void fail(const char *what);
+
+public:
+	ProcUring(unsigned entries = 256);
+	virtual ~ProcUring();
+	static bool available(void);
+	static void enable(void);
+	bool ready(void) const;
+	bool read(const char *const pids[], size_t n, const char *const names[],
+			size_t count);
+
+	// File name of PID pid of the last read()
+	File &get(size_t pid, size_t name) {
+		return files[pid * count + name];
+	}
+};
+
+#endif /* PROCURING_H_ */
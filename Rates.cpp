@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <unistd.h>
+#include <math.h>
+}
+
+#include "Rates.h"
+#include "PidSchema.h"
+
+// Rates are per second, in thousandths: a utime_rate of 1000 is one CPU
+// kept busy in user mode, a majflt_rate of 500 one major fault every two
+// seconds
+static const double rate_scale = 1000;
+
+Rates::Rates() :
+		previous_time(0), ticks_per_second(sysconf(_SC_CLK_TCK)) {
+}
+
+Rates::~Rates() {
+}
+
+// -1 where a counter went backwards, which only a PID reused within one
+// clock tick could cause
+int64_t Rates::rate(int64_t from, int64_t to, double per_second) {
+	if (to < from)
+		return -1;
+	return llround((to - from) * per_second * rate_scale);
+}
+
+// Processes without an earlier sample, and every process of the first
+// snapshot, get -1
+void Rates::compute(PidTable &pids, const Clock &node_time) {
+	current.resize(pids.size());
+	for (size_t i = 0; i < pids.size(); ++i) {
+		Sample &s = current[i];
+		s.pid = pids.pid(i);
+		s.starttime = pids.starttime(i);
+		s.utime = pids.number(PidSchema::utime, i);
+		s.stime = pids.number(PidSchema::stime, i);
+		s.minflt = pids.number(PidSchema::minflt, i);
+		s.majflt = pids.number(PidSchema::majflt, i);
+		s.read_time = pids.number(PidSchema::read_time, i);
+	}
+
+	int64_t elapsed = node_time.getMonotonic() - previous_time;
+	size_t old = 0;
+	for (size_t now = 0; now < current.size(); ++now) {
+		const Sample &s = current[now];
+		while (old < previous.size() && previous[old].pid < s.pid)
+			++old;
+
+		int64_t utime = -1, stime = -1, minflt = -1, majflt = -1;
+		if (old < previous.size() && previous[old].pid == s.pid
+				&& previous[old].starttime == s.starttime) {
+			const Sample &p = previous[old];
+			int64_t ns = p.read_time != 0 && s.read_time != 0 ?
+					s.read_time - p.read_time : elapsed;
+			if (ns > 0) {
+				double per_second = 1e9 / ns;
+				utime = rate(p.utime, s.utime, per_second / ticks_per_second);
+				stime = rate(p.stime, s.stime, per_second / ticks_per_second);
+				minflt = rate(p.minflt, s.minflt, per_second);
+				majflt = rate(p.majflt, s.majflt, per_second);
+			}
+		}
+		pids.numbers[PidSchema::utime_rate][now] = utime;
+		pids.numbers[PidSchema::stime_rate][now] = stime;
+		pids.numbers[PidSchema::minflt_rate][now] = minflt;
+		pids.numbers[PidSchema::majflt_rate][now] = majflt;
+	}
+
+	previous.swap(current);
+	previous_time = node_time.getMonotonic();
+}
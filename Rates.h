@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef RATES_H_
+#define RATES_H_
+
+extern "C" {
+#include <stdint.h>
+#include <sys/types.h>
+}
+
+#include <vector>
+#include "PidTable.h"
+#include "Clock.h"
+
+using namespace std;
+
+// Fills in the rate columns of each snapshot from the one before, so that
+// consumers need not join every set to the previous one for CPU use and
+// page faults. Like Delta, it matches processes on (pid, starttime) in a
+// single merge pass over the PID ordered snapshots. The interval is the
+// time between the two reads of the process with --read-times and between
+// the two snapshots otherwise.
+class Rates {
+private:
+	struct Sample {
+		pid_t pid;
+		uint64_t starttime;
+		int64_t utime;
+		int64_t stime;
+		int64_t minflt;
+		int64_t majflt;
+		int64_t read_time;
+	};
+
+	vector<Sample> previous;
+	vector<Sample> current;
+	int64_t previous_time;	// CLOCK_MONOTONIC nanoseconds
+	double ticks_per_second;
+
+	static int64_t rate(int64_t from, int64_t to, double per_second);
+
+public:
+	Rates();
+	virtual ~Rates();
+	void compute(PidTable &pids, const Clock &node_time);
+};
+
+#endif /* RATES_H_ */
@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <arpa/inet.h>
+}
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include "Recording.h"
+#include "Snapshot.h"
+#include "Delta.h"
+#include "Pgsql.h"
+#include "Clock.h"
+
+static const char recording_magic[8] = { 'P', 'I', 'D', 'S', 'R', 'E', 'C', '1' };
+
+// Snapshot records are a few hundred KB at most, anything past this is a
+// damaged length
+static const uint32_t recording_max = 64 << 20;
+
+Recording::Recording() :
+		file(NULL) {
+}
+
+Recording::~Recording() {
+	close();
+}
+
+// Start a new recording, replacing any file at path
+bool Recording::create(const string &path) {
+	close();
+	this->path = path;
+	file = fopen(path.c_str(), "wbe");
+	if (file == NULL) {
+		perror(path.c_str());
+		return false;
+	}
+	if (fwrite(recording_magic, sizeof(recording_magic), 1, file) != 1
+			|| fflush(file) != 0) {
+		perror(path.c_str());
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool Recording::open(const string &path) {
+	close();
+	this->path = path;
+	file = fopen(path.c_str(), "rbe");
+	if (file == NULL) {
+		perror(path.c_str());
+		return false;
+	}
+	char magic[sizeof(recording_magic)];
+	if (fread(magic, sizeof(magic), 1, file) != 1
+			|| equal(magic, magic + sizeof(magic), recording_magic) == false) {
+		cerr << path << " is not a recording" << endl;
+		close();
+		return false;
+	}
+	return true;
+}
+
+void Recording::close(void) {
+	if (file != NULL) {
+		fclose(file);
+		file = NULL;
+	}
+}
+
+// Each snapshot is flushed, a collector that is killed loses at most the
+// one it was writing
+bool Recording::append(const string &record) {
+	if (file == NULL)
+		return false;
+
+	uint32_t length = htonl(record.size());
+	if (fwrite(&length, sizeof(length), 1, file) != 1
+			|| fwrite(record.data(), record.size(), 1, file) != 1
+			|| fflush(file) != 0) {
+		perror(path.c_str());
+		return false;
+	}
+	return true;
+}
+
+// False at the end of the recording, or at a snapshot that was cut off
+bool Recording::next(string &record) {
+	if (file == NULL)
+		return false;
+
+	uint32_t length;
+	if (fread(&length, sizeof(length), 1, file) != 1)
+		return false;
+	length = ntohl(length);
+	if (length > recording_max) {
+		cerr << path << ": damaged snapshot length " << length << endl;
+		return false;
+	}
+
+	record.resize(length);
+	if (length > 0 && fread(&record[0], length, 1, file) != 1) {
+		cerr << path << ": the last snapshot was cut off" << endl;
+		return false;
+	}
+	return true;
+}
+
+static double since(const timespec &start) {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Each recorded snapshot is due (node_time - first node_time) / speed
+// seconds after the start, speed 0 sends them as fast as they are stored.
+// A node's sets keep their recorded spacing and are moved to start now, so
+// node names and times do not collide with those of an earlier run unless
+// it overlaps; snapshots recorded within the same microsecond, the
+// resolution of node_time in pid_sets, are moved to the next free one.
+// With more than one node, node n stores its copy as nodename-n. The lag
+// behind schedule shows when the server cannot keep up.
+int Recording::play(const string &path, double speed, unsigned nodes,
+		Pgsql &db, SetWriter::Method method, volatile sig_atomic_t &stop) {
+	Recording recording;
+	if (recording.open(path) == false)
+		return EXIT_FAILURE;
+
+	timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int64_t base = Clock().nanoseconds();
+	int64_t first = 0, last = 0;
+	uint64_t snapshots = 0, stored = 0, failed = 0, rows_stored = 0;
+	double max_lag = 0;
+
+	string record;
+	Snapshot snapshot;
+	vector<Delta::Row> rows;
+	while (stop == 0 && recording.next(record)) {
+		if (snapshot.decode(record.data(), record.size()) == false) {
+			cerr << "Skipping a snapshot that does not decode." << endl;
+			continue;
+		}
+		if (snapshots++ == 0) {
+			first = snapshot.node_time;
+		}
+
+		int64_t offset = snapshot.node_time - first;
+		if (speed > 0) {
+			double due = offset / 1e9 / speed;
+			timespec until = start;
+			until.tv_sec += time_t(due);
+			until.tv_nsec += long((due - time_t(due)) * 1e9);
+			if (until.tv_nsec >= 1000000000) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+			// A signal ends the wait early so stop is seen
+			while (stop == 0
+					&& clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until,
+							NULL) == EINTR) {
+			}
+			max_lag = max(max_lag, since(start) - due);
+		}
+
+		rows.resize(snapshot.pids.size());
+		for (size_t i = 0; i < snapshot.pids.size(); ++i) {
+			rows[i].change = 0;
+			rows[i].table = &snapshot.pids;
+			rows[i].row = i;
+		}
+
+		// pid_sets is unique on (nodename, node_time)
+		int64_t at = max(base + offset, last + 1000);
+		last = at;
+		Clock node_time(at);
+		for (unsigned node = 0; node < nodes && stop == 0; ++node) {
+			stringstream nodename;
+			nodename << snapshot.nodename;
+			if (nodes > 1) {
+				nodename << "-" << node;
+			}
+
+			bool ok = false;
+			try {
+				if (db.connected() || db.reconnect()) {
+					ok = SetWriter::write(db, nodename.str(), node_time, true,
+							rows, method);
+				}
+			} catch(Pgsql::Error *e) {
+				delete e;
+			}
+			if (ok) {
+				++stored;
+				rows_stored += rows.size();
+			} else {
+				++failed;
+			}
+		}
+	}
+
+	double seconds = since(start);
+	cout << "Replayed " << snapshots << " snapshots as " << stored << " sets ("
+			<< failed << " failed, " << rows_stored << " rows) in " << seconds
+			<< " s: " << stored / seconds << " sets/s, "
+			<< rows_stored / seconds << " rows/s";
+	if (speed > 0) {
+		cout << ", at most " << max_lag << " s behind";
+	}
+	cout << endl;
+
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef RECORDING_H_
+#define RECORDING_H_
+
+extern "C" {
+#include <stdio.h>
+#include <signal.h>
+}
+
+#include <string>
+
+#include "SetWriter.h"
+
+using namespace std;
+
+class Pgsql;
+
+// A file of snapshots as --record captured them: a magic, then each
+// snapshot record (see Snapshot) behind its length as a big-endian uint32.
+// play() stores them again through SetWriter::write(), as keyframes of
+// nodes distinct nodes, at speed times the pace they were taken at.
+class Recording {
+private:
+	FILE *file;
+	string path;
+
+public:
+	Recording();
+	virtual ~Recording();
+	bool create(const string &path);
+	bool open(const string &path);
+	void close(void);
+	bool append(const string &record);
+	bool next(string &record);
+	static int play(const string &path, double speed, unsigned nodes,
+			Pgsql &db, SetWriter::Method method,
+			volatile sig_atomic_t &stop);
+};
+
+#endif /* RECORDING_H_ */
@@ -0,0 +1,520 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+}
+
+#include <iostream>
+#include <algorithm>
+#include "Relay.h"
+#include "Snapshot.h"
+#include "SetWriter.h"
+
+// Most sets stored in one transaction, the largest frame accepted, and
+// how long a collector waits for its answer
+static const size_t relay_batch = 64;
+static const uint32_t relay_max_frame = 64 << 20;
+static const int relay_timeout = 60;
+
+// Split an address into a Unix socket path or a host and port. The host
+// may be empty for a listener, which then accepts on every interface.
+static bool parseAddress(const string &address, string &path, string &host,
+		string &port) {
+	if (address.compare(0, 5, "unix:") == 0) {
+		path = address.substr(5);
+		return path.empty() == false;
+	}
+	if (address.empty() || address[0] == '/' || address[0] == '.') {
+		path = address;
+		return path.empty() == false;
+	}
+
+	size_t colon = address.rfind(':');
+	if (colon == string::npos)
+		return false;
+	host = address.substr(0, colon);
+	port = address.substr(colon + 1);
+	if (host.size() >= 2 && host[0] == '[' && host[host.size() - 1] == ']')
+		host = host.substr(1, host.size() - 2);
+	return port.empty() == false;
+}
+
+// A connected or listening socket for address, -1 on failure
+int RelayClient::open(const string &address, bool listening) {
+	string path, host, port;
+	if (parseAddress(address, path, host, port) == false) {
+		cerr << "Invalid relay address: " << address << endl;
+		return -1;
+	}
+
+	if (path.empty() == false) {
+		struct sockaddr_un sun;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(sun.sun_path)) {
+			cerr << "Socket path too long: " << path << endl;
+			return -1;
+		}
+		strcpy(sun.sun_path, path.c_str());
+
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd == -1) {
+			perror("socket");
+			return -1;
+		}
+		if (listening) {
+			unlink(path.c_str());
+			if (bind(fd, reinterpret_cast<struct sockaddr *>(&sun), sizeof(sun))
+					== -1 || ::listen(fd, SOMAXCONN) == -1) {
+				perror(path.c_str());
+				close(fd);
+				return -1;
+			}
+		} else if (connect(fd, reinterpret_cast<struct sockaddr *>(&sun),
+				sizeof(sun)) == -1) {
+			perror(path.c_str());
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = listening ? AI_PASSIVE : 0;
+	int rc = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(),
+			&hints, &res);
+	if (rc != 0) {
+		cerr << address << ": " << gai_strerror(rc) << endl;
+		return -1;
+	}
+
+	int fd = -1;
+	for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+				ai->ai_protocol);
+		if (fd == -1)
+			continue;
+		if (listening) {
+			int on = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0
+					&& ::listen(fd, SOMAXCONN) == 0)
+				break;
+		} else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd == -1)
+		cerr << address << ": " << strerror(errno) << endl;
+	return fd;
+}
+
+RelayClient::RelayClient(const string &address) :
+		address(address), fd(-1) {
+}
+
+RelayClient::~RelayClient() {
+	disconnect();
+}
+
+void RelayClient::disconnect(void) {
+	if (fd != -1) {
+		close(fd);
+		fd = -1;
+	}
+}
+
+RelayClient::Status RelayClient::send(const string &record) {
+	if (fd == -1) {
+		fd = open(address, false);
+		if (fd == -1)
+			return FAILED;
+		struct timeval tv = { relay_timeout, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	}
+
+	uint32_t length = htonl(record.length());
+	string frame(reinterpret_cast<const char *>(&length), sizeof(length));
+	frame += record;
+
+	size_t sent = 0;
+	while (sent < frame.length()) {
+		ssize_t n = ::send(fd, frame.data() + sent, frame.length() - sent,
+				MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			cerr << "Unable to send to relay " << address << ": "
+					<< strerror(errno) << endl;
+			disconnect();
+			return FAILED;
+		}
+		sent += n;
+	}
+
+	char status;
+	ssize_t n;
+	while ((n = recv(fd, &status, 1, 0)) == -1 && errno == EINTR)
+		;
+	if (n != 1 || (status != STORED && status != FAILED && status != REFUSED)) {
+		cerr << "No answer from relay " << address << endl;
+		disconnect();
+		return FAILED;
+	}
+	return Status(status);
+}
+
+Relay::Relay(const string &dbhost, const string &dbname, const string &dbuser,
+		const string &dbpass, bool debug) :
+		dbhost(dbhost), dbname(dbname), dbuser(dbuser), dbpass(dbpass),
+		debug(debug), listener(-1), wakeup(-1), next_client(0),
+		stopping(false) {
+}
+
+Relay::~Relay() {
+	for (map<uint64_t, Client>::iterator i = clients.begin();
+			i != clients.end(); ++i)
+		close(i->second.fd);
+	if (listener != -1)
+		close(listener);
+	if (wakeup != -1)
+		close(wakeup);
+	if (socket_path.empty() == false)
+		unlink(socket_path.c_str());
+}
+
+bool Relay::listen(const string &address) {
+	string path, host, port;
+	if (parseAddress(address, path, host, port))
+		socket_path = path;
+
+	listener = RelayClient::open(address, true);
+	if (listener == -1)
+		return false;
+	fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+	wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup == -1) {
+		perror("eventfd");
+		return false;
+	}
+	return true;
+}
+
+int Relay::run(unsigned connections, volatile sig_atomic_t &stop) {
+	if (connections == 0)
+		connections = 1;
+	for (unsigned i = 0; i < connections; ++i)
+		writers.push_back(thread(&Relay::writer, this));
+
+	vector<struct pollfd> fds;
+	vector<uint64_t> ids;
+	while (stop == 0) {
+		fds.clear();
+		ids.clear();
+		struct pollfd pfd;
+		pfd.fd = listener;
+		pfd.events = POLLIN;
+		fds.push_back(pfd);
+		pfd.fd = wakeup;
+		fds.push_back(pfd);
+		for (map<uint64_t, Client>::iterator i = clients.begin();
+				i != clients.end(); ++i) {
+			pfd.fd = i->second.fd;
+			pfd.events = POLLIN | (i->second.out.empty() ? 0 : POLLOUT);
+			fds.push_back(pfd);
+			ids.push_back(i->first);
+		}
+
+		if (poll(&fds[0], fds.size(), 1000) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			uint64_t count;
+			if (read(wakeup, &count, sizeof(count)) == -1 && errno != EAGAIN)
+				perror("read");
+			deliver();
+		}
+
+		for (size_t i = 2; i < fds.size(); ++i) {
+			if (fds[i].revents == 0)
+				continue;
+			map<uint64_t, Client>::iterator c = clients.find(ids[i - 2]);
+			if (c == clients.end())
+				continue;
+			bool open = true;
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				open = receive(c->first, c->second);
+			if (open && (fds[i].revents & POLLOUT))
+				open = flush(c->second);
+			if (open == false) {
+				close(c->second.fd);
+				clients.erase(c);
+			}
+		}
+
+		if (fds[0].revents & POLLIN)
+			accept();
+	}
+
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	work.notify_all();
+	for (vector<thread>::iterator i = writers.begin(); i != writers.end(); ++i)
+		i->join();
+	writers.clear();
+
+	return EXIT_SUCCESS;
+}
+
+void Relay::accept(void) {
+	int fd;
+	while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC))
+			!= -1) {
+		Client &c = clients[next_client++];
+		c.fd = fd;
+		if (debug)
+			cerr << "Relay: collector connected, " << clients.size()
+					<< " connected" << endl;
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		perror("accept");
+}
+
+// Read what the collector sent and queue every complete frame. False once
+// the connection is closed or breaks the protocol.
+bool Relay::receive(uint64_t id, Client &c) {
+	char buffer[65536];
+	bool open = true;
+	while (true) {
+		ssize_t n = read(c.fd, buffer, sizeof(buffer));
+		if (n > 0) {
+			c.in.append(buffer, n);
+			continue;
+		}
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			open = false;
+		break;
+	}
+
+	size_t consumed = 0;
+	size_t queued = 0;
+	{
+		lock_guard<mutex> guard(lock);
+		while (c.in.size() - consumed >= sizeof(uint32_t)) {
+			uint32_t length;
+			memcpy(&length, c.in.data() + consumed, sizeof(length));
+			length = ntohl(length);
+			if (length > relay_max_frame) {
+				cerr << "Relay: dropping a collector that sent a frame of "
+						<< length << " bytes" << endl;
+				return false;
+			}
+			if (c.in.size() - consumed - sizeof(length) < length)
+				break;
+
+			Pending p;
+			p.client = id;
+			p.record.assign(c.in, consumed + sizeof(length), length);
+			pending.push_back(p);
+			consumed += sizeof(length) + length;
+			++queued;
+		}
+	}
+	c.in.erase(0, consumed);
+	if (queued > 0)
+		work.notify_one();
+
+	return open;
+}
+
+bool Relay::flush(Client &c) {
+	while (c.out.empty() == false) {
+		ssize_t n = ::send(c.fd, c.out.data(), c.out.size(),
+				MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if (n <= 0)
+			return false;
+		c.out.erase(0, n);
+	}
+	return true;
+}
+
+// Hand the answers of finished transactions to the collectors still
+// connected
+void Relay::deliver(void) {
+	vector<Ack> done;
+	{
+		lock_guard<mutex> guard(lock);
+		done.swap(acks);
+	}
+
+	for (vector<Ack>::iterator a = done.begin(); a != done.end(); ++a) {
+		map<uint64_t, Client>::iterator c = clients.find(a->client);
+		if (c == clients.end())
+			continue;
+		c->second.out.push_back(a->status);
+	}
+	for (map<uint64_t, Client>::iterator c = clients.begin();
+			c != clients.end();) {
+		if (flush(c->second)) {
+			++c;
+		} else {
+			close(c->second.fd);
+			clients.erase(c++);
+		}
+	}
+}
+
+void Relay::writer(void) {
+	// Stop signals are for the polling thread
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	Pgsql *db = NULL;
+	vector<Pending> batch;
+	vector<Ack> done;
+	unique_lock<mutex> guard(lock);
+	while (true) {
+		while (stopping == false && pending.empty())
+			work.wait(guard);
+		if (stopping)
+			break;
+
+		batch.clear();
+		while (pending.empty() == false && batch.size() < relay_batch) {
+			batch.push_back(Pending());
+			batch.back().client = pending.front().client;
+			batch.back().record.swap(pending.front().record);
+			pending.pop_front();
+		}
+		guard.unlock();
+
+		done.clear();
+		store(db, batch, done);
+
+		guard.lock();
+		acks.insert(acks.end(), done.begin(), done.end());
+		uint64_t one = 1;
+		if (write(wakeup, &one, sizeof(one)) == -1)
+			perror("write");
+	}
+	guard.unlock();
+
+	delete db;
+}
+
+// Store a batch in one transaction. If the server refuses it while the
+// connection is fine, each snapshot is tried on its own so one bad
+// snapshot does not fail the others.
+void Relay::store(Pgsql *&db, vector<Pending> &batch, vector<Ack> &done) {
+	vector<Snapshot> snapshots(batch.size());
+	vector<const Snapshot *> valid;
+	vector<uint64_t> clients;
+	for (size_t i = 0; i < batch.size(); ++i) {
+		Ack a;
+		a.client = batch[i].client;
+		if (snapshots[i].decode(batch[i].record.data(),
+				batch[i].record.length())) {
+			valid.push_back(&snapshots[i]);
+			clients.push_back(a.client);
+		} else {
+			a.status = RelayClient::REFUSED;
+			done.push_back(a);
+		}
+	}
+	if (valid.empty())
+		return;
+
+	bool reachable = true;
+	try {
+		if (db == NULL) {
+			db = new Pgsql(dbhost.c_str(), dbname.c_str(), dbuser.c_str(),
+					dbpass.c_str(), debug);
+			db->disablePipeline();
+		} else if (db->connected() == false && db->reconnect() == false) {
+			reachable = false;
+		}
+	} catch (Pgsql::Error *e) {
+		delete e;
+		reachable = false;
+	}
+
+	vector<char> status(valid.size(), RelayClient::FAILED);
+	if (reachable && SetWriter::store(*db, valid)) {
+		status.assign(valid.size(), RelayClient::STORED);
+	} else if (reachable && db->connected() && valid.size() == 1) {
+		status[0] = RelayClient::REFUSED;
+	} else if (reachable && db->connected()) {
+		for (size_t i = 0; i < valid.size(); ++i) {
+			vector<const Snapshot *> one(1, valid[i]);
+			if (SetWriter::store(*db, one))
+				status[i] = RelayClient::STORED;
+			else if (db->connected())
+				status[i] = RelayClient::REFUSED;
+			else
+				break;
+		}
+	}
+
+	if (debug) {
+		cerr << "Relay: stored " << count(status.begin(), status.end(),
+				char(RelayClient::STORED)) << " of " << valid.size()
+				<< " sets" << endl;
+	}
+	for (size_t i = 0; i < valid.size(); ++i) {
+		Ack a;
+		a.client = clients[i];
+		a.status = status[i];
+		done.push_back(a);
+	}
+}
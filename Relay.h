@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef RELAY_H_
+#define RELAY_H_
+
+extern "C" {
+#include <stdint.h>
+#include <signal.h>
+}
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "Pgsql.h"
+
+using namespace std;
+
+// Sends encoded snapshots to a relay and waits for each to be stored.
+// Addresses are a Unix socket path, unix:path, host:port or [host]:port.
+// A frame is the record length as a 32 bit big-endian number followed by
+// the record; the relay answers each frame with one status byte once the
+// transaction holding it has ended.
+class RelayClient {
+public:
+	enum Status {
+		STORED = '+', FAILED = '-', REFUSED = 'x'
+	};
+
+private:
+	string address;
+	int fd;
+
+public:
+	RelayClient(const string &address);
+	virtual ~RelayClient();
+	Status send(const string &record);
+	void disconnect(void);
+
+	static int open(const string &address, bool listening);
+};
+
+// Accepts snapshots from many collectors and stores them on a few pooled
+// connections. One thread polls the sockets and cuts frames; writer
+// threads, each with its own Pgsql, take whatever has queued up meanwhile,
+// from any number of nodes, and store it with SetWriter in one
+// transaction. Collectors get FAILED when the database cannot be reached
+// and keep the snapshot in their spool; a snapshot the server refuses on
+// its own, or that cannot be decoded, is REFUSED.
+class Relay {
+private:
+	struct Client {
+		int fd;
+		string in;
+		string out;
+	};
+
+	struct Pending {
+		uint64_t client;
+		string record;
+	};
+
+	struct Ack {
+		uint64_t client;
+		char status;
+	};
+
+	string dbhost;
+	string dbname;
+	string dbuser;
+	string dbpass;
+	bool debug;
+
+	int listener;
+	int wakeup;
+	string socket_path;
+	map<uint64_t, Client> clients;
+	uint64_t next_client;
+
+	mutex lock;
+	condition_variable work;
+	deque<Pending> pending;
+	vector<Ack> acks;
+	bool stopping;
+	vector<thread> writers;
+
+	void writer(void);
+	void store(Pgsql *&db, vector<Pending> &batch, vector<Ack> &done);
+	void accept(void);
+	bool receive(uint64_t id, Client &c);
+	bool flush(Client &c);
+	void deliver(void);
+
+public:
+	Relay(const string &dbhost, const string &dbname, const string &dbuser,
+			const string &dbpass, bool debug);
+	virtual ~Relay();
+	bool listen(const string &address);
+	int run(unsigned connections, volatile sig_atomic_t &stop);
+};
+
+#endif /* RELAY_H_ */
@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+}
+
+#include <iostream>
+#include <chrono>
+#include "Replay.h"
+#include "SetWriter.h"
+
+// Snapshots stored in one transaction, and how long to wait before trying
+// again after the database could not be reached
+static const size_t replay_batch = 16;
+static const chrono::seconds replay_retry(10);
+
+Replay::Replay(Spool &spool, const string &dbhost, const string &dbname,
+		const string &dbuser, const string &dbpass, const string &relay_addr,
+		bool debug) :
+		spool(spool), dbhost(dbhost), dbname(dbname), dbuser(dbuser),
+		dbpass(dbpass), relay_addr(relay_addr), debug(debug), stopping(false), draining(false),
+		batch(replay_batch), stored(0) {
+	worker = thread(&Replay::run, this);
+}
+
+Replay::~Replay() {
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_one();
+	if (worker.joinable())
+		worker.join();
+}
+
+// Called after a snapshot was appended to the spool
+void Replay::notify(void) {
+	lock_guard<mutex> guard(lock);
+	wake.notify_one();
+}
+
+// Store what can be stored now and stop, for runs that take one snapshot
+void Replay::finish(void) {
+	{
+		lock_guard<mutex> guard(lock);
+		draining = true;
+	}
+	wake.notify_one();
+	if (worker.joinable())
+		worker.join();
+}
+
+uint64_t Replay::getStored(void) {
+	lock_guard<mutex> guard(lock);
+	return stored;
+}
+
+void Replay::run(void) {
+	// Stop signals are for the sampling loop
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	Pgsql *db = NULL;
+	RelayClient relay(relay_addr);
+	unique_lock<mutex> guard(lock);
+	while (stopping == false) {
+		if (spool.empty()) {
+			if (draining)
+				break;
+			wake.wait(guard);
+			continue;
+		}
+
+		guard.unlock();
+		bool ok = relay_addr.empty() ? drain(db) : drain(relay);
+		guard.lock();
+		if (ok == false) {
+			// New snapshots do not cut the wait short
+			chrono::steady_clock::time_point retry = chrono::steady_clock::now()
+					+ replay_retry;
+			while (stopping == false && draining == false
+					&& chrono::steady_clock::now() < retry)
+				wake.wait_until(guard, retry);
+			if (draining)
+				break;
+		}
+	}
+	guard.unlock();
+
+	delete db;
+}
+
+// Store the oldest batch of the spool in one transaction. A batch the
+// server refuses is retried one snapshot at a time, and a single snapshot
+// it refuses is dropped so it cannot hold up the ones behind it.
+bool Replay::drain(Pgsql *&db) {
+	try {
+		if (db == NULL) {
+			db = new Pgsql(dbhost.c_str(), dbname.c_str(), dbuser.c_str(),
+					dbpass.c_str(), debug);
+			db->disablePipeline();
+		} else if (db->connected() == false && db->reconnect() == false) {
+			return false;
+		}
+	} catch (Pgsql::Error *e) {
+		delete e;
+		return false;
+	}
+
+	vector<string> records;
+	uint64_t first = spool.front(records, batch);
+	if (records.empty())
+		return true;
+
+	vector<Snapshot> snapshots(records.size());
+	vector<const Snapshot *> valid;
+	for (size_t i = 0; i < records.size(); ++i) {
+		if (snapshots[i].decode(records[i].data(), records[i].length()))
+			valid.push_back(&snapshots[i]);
+		else
+			cerr << "Skipping a spooled snapshot that cannot be read" << endl;
+	}
+	bool ok = SetWriter::store(*db, valid);
+
+	if (ok) {
+		spool.pop(first + records.size());
+		lock_guard<mutex> guard(lock);
+		stored += records.size();
+		batch = replay_batch;
+		if (debug) {
+			cerr << "Replayed " << records.size() << " spooled snapshots, "
+					<< spool.size() << " left" << endl;
+		}
+		return true;
+	}
+
+	if (db->connected() == false)
+		return false;
+
+	if (batch > 1) {
+		batch = 1;
+		return true;
+	}
+
+	cerr << "Dropping a spooled snapshot the database refuses" << endl;
+	spool.pop(first + 1);
+	return true;
+}
+
+// Send the oldest snapshots to the relay, one at a time as the relay
+// answers each when its transaction ends
+bool Replay::drain(RelayClient &relay) {
+	vector<string> records;
+	uint64_t first = spool.front(records, batch);
+	for (size_t i = 0; i < records.size(); ++i) {
+		RelayClient::Status status = relay.send(records[i]);
+		if (status == RelayClient::FAILED)
+			return false;
+		if (status == RelayClient::REFUSED)
+			cerr << "Dropping a spooled snapshot the relay refuses" << endl;
+		spool.pop(first + i + 1);
+
+		lock_guard<mutex> guard(lock);
+		stored += status == RelayClient::STORED;
+	}
+	return true;
+}
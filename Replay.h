@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+extern "C" {
+#include <stdint.h>
+}
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "Spool.h"
+#include "Snapshot.h"
+#include "Pgsql.h"
+#include "Relay.h"
+
+using namespace std;
+
+// Drains the spool into the database, or to the relay when relay_addr is
+// given, from a thread of its own, on its own connection, oldest snapshots
+// first and several to a transaction. A snapshot leaves the spool only
+// after it is committed, so it can be stored twice if the commit succeeds
+// but its reply is lost. pid_sets has a unique index on (nodename,
+// node_time) and SetWriter skips a snapshot whose set already exists,
+// which makes the second store a no-op.
+class Replay {
+private:
+	Spool &spool;
+	string dbhost;
+	string dbname;
+	string dbuser;
+	string dbpass;
+	string relay_addr;
+	bool debug;
+
+	thread worker;
+	mutex lock;
+	condition_variable wake;
+	bool stopping;
+	bool draining;
+	size_t batch;
+	uint64_t stored;
+
+	void run(void);
+	bool drain(Pgsql *&db);
+	bool drain(RelayClient &relay);
+
+public:
+	Replay(Spool &spool, const string &dbhost, const string &dbname,
+			const string &dbuser, const string &dbpass,
+			const string &relay_addr, bool debug);
+	virtual ~Replay();
+	void notify(void);
+	void finish(void);
+	uint64_t getStored(void);
+};
+
+#endif /* REPLAY_H_ */
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <errno.h>
+}
+
+#include "Sampler.h"
+
+static const int64_t nsec_per_sec = 1000000000;
+
+Sampler::Sampler(unsigned interval_ms, bool align) :
+		interval(int64_t(interval_ms) * 1000000), align(align && interval_ms > 0),
+		next(now()), cycleStart(0), lastCycle(0), maxCycle(0), cycles(0),
+		overruns(0), missed(0), lastOverrun(false) {
+	if (this->align) {
+		// Half an interval on, the closest boundary is the next one
+		next = aligned(next + interval / 2);
+	}
+}
+
+Sampler::~Sampler() {
+}
+
+int64_t Sampler::now(void) {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return int64_t(ts.tv_sec) * nsec_per_sec + ts.tv_nsec;
+}
+
+// The CLOCK_MONOTONIC time of the wall clock boundary closest to tick.
+// The wall clock is stepped and slewed against the monotonic one, so the
+// offset between them is taken again for every tick.
+int64_t Sampler::aligned(int64_t tick) {
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	int64_t offset = int64_t(ts.tv_sec) * nsec_per_sec + ts.tv_nsec - now();
+	int64_t wall = tick + offset;
+	return (wall + interval / 2) / interval * interval - offset;
+}
+
+// Sleep until the next tick. Returns false if the sleep was interrupted by
+// a signal, so the caller can check whether it was asked to stop.
+bool Sampler::wait(void) {
+	timespec deadline;
+	deadline.tv_sec = next / nsec_per_sec;
+	deadline.tv_nsec = next % nsec_per_sec;
+
+	int rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+	if (rc == EINTR) {
+		return false;
+	}
+
+	cycleStart = now();
+	return true;
+}
+
+void Sampler::done(void) {
+	int64_t end = now();
+
+	cycles++;
+	lastCycle = end - cycleStart;
+	if (lastCycle > maxCycle) {
+		maxCycle = lastCycle;
+	}
+
+	next += interval;
+	if (align) {
+		next = aligned(next);
+	}
+	lastOverrun = end > next;
+	if (lastOverrun) {
+		int64_t skipped = (end - next) / interval + 1;
+		overruns++;
+		missed += skipped;
+		next += skipped * interval;
+	}
+}
+
+uint64_t Sampler::getCycles(void) {
+	return cycles;
+}
+
+uint64_t Sampler::getOverruns(void) {
+	return overruns;
+}
+
+uint64_t Sampler::getMissed(void) {
+	return missed;
+}
+
+bool Sampler::overran(void) {
+	return lastOverrun;
+}
+
+int64_t Sampler::getLastCycle(void) {
+	return lastCycle;
+}
+
+int64_t Sampler::getMaxCycle(void) {
+	return maxCycle;
+}
+
+ostream& operator<<(ostream &os, const Sampler &s) {
+	os << "cycles=" << s.cycles << " overruns=" << s.overruns << " missed="
+			<< s.missed << " last_ms=" << s.lastCycle / 1000000.0 << " max_ms="
+			<< s.maxCycle / 1000000.0;
+	return os;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef SAMPLER_H_
+#define SAMPLER_H_
+
+extern "C" {
+#include <stdint.h>
+#include <time.h>
+}
+
+#include <iostream>
+
+using namespace std;
+
+// Fixed-rate tick source. Ticks are absolute CLOCK_MONOTONIC deadlines that
+// advance by exactly one interval, so time spent in a cycle never shifts
+// the schedule. A cycle that runs past its next tick is counted as an
+// overrun and the ticks it covered are skipped rather than fired late.
+// Aligned ticks fall on multiples of the interval in wall clock time, so
+// every node samples at the same moments.
+class Sampler {
+private:
+	int64_t interval;	// nanoseconds
+	bool align;
+	int64_t next;		// next tick, CLOCK_MONOTONIC nanoseconds
+	int64_t cycleStart;
+	int64_t lastCycle;
+	int64_t maxCycle;
+	uint64_t cycles;
+	uint64_t overruns;
+	uint64_t missed;
+	bool lastOverrun;
+
+	static int64_t now(void);
+	int64_t aligned(int64_t tick);
+
+public:
+	Sampler(unsigned interval_ms, bool align = false);
+	virtual ~Sampler();
+	bool wait(void);
+	void done(void);
+	uint64_t getCycles(void);
+	uint64_t getOverruns(void);
+	uint64_t getMissed(void);
+	bool overran(void);
+	int64_t getLastCycle(void);
+	int64_t getMaxCycle(void);
+	friend ostream& operator<<(ostream &os, const Sampler &s);
+};
+
+ostream& operator<<(ostream &os, const Sampler &s);
+
+#endif /* SAMPLER_H_ */
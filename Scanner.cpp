@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <stdio.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include "Scanner.h"
+#include "ProcReader.h"
+#include "Metrics.h"
+
+// PIDs handed out per claim; small enough to balance, large enough that
+// the atomic traffic does not show up next to the procfs reads
+static const size_t chunk_size = 32;
+
+// Digit strings without leading zeros sort numerically by length first
+static bool pidOrder(const string &a, const string &b) {
+	if (a.size() != b.size())
+		return a.size() < b.size();
+	return a < b;
+}
+
+Scanner::Scanner(unsigned threads) :
+		threads(threads), generation(0), running(0), stopping(false),
+		ranges(NULL) {
+	if (this->threads == 0) {
+		this->threads = thread::hardware_concurrency();
+	}
+	if (this->threads == 0) {
+		this->threads = 1;
+	}
+
+	ranges = new Range[this->threads];
+	for (unsigned id = 0; id < this->threads; ++id) {
+		rings.push_back(ProcUring::available() ? new ProcUring() : NULL);
+	}
+
+	// The calling thread is worker 0
+	for (unsigned id = 1; id < this->threads; ++id) {
+		workers.push_back(thread(&Scanner::worker, this, id));
+	}
+}
+
+Scanner::~Scanner() {
+	{
+		unique_lock<mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (vector<thread>::iterator i = workers.begin(); i != workers.end(); ++i) {
+		i->join();
+	}
+
+	delete[] ranges;
+	for (vector<ProcUring *>::iterator i = rings.begin(); i != rings.end(); ++i) {
+		delete *i;
+	}
+}
+
+unsigned Scanner::getThreads(void) {
+	return threads;
+}
+
+void Scanner::enumerate(void) {
+	Metrics::Timer timer(Metrics::ENUMERATE);
+	names.clear();
+
+	// A private descriptor gives this scan its own directory offset
+	int fd = openat(ProcReader::getRootFd(), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+	if (dir == NULL) {
+		perror("opendir");
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+
+	dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] >= '0' && entry->d_name[0] <= '9') {
+			names.push_back(entry->d_name);
+		}
+	}
+	closedir(dir);
+
+	sort(names.begin(), names.end(), pidOrder);
+}
+
+void Scanner::parseChunk(size_t chunk, unsigned id) {
+	PidTable &out = chunks[chunk];
+	size_t end = min(names.size(), (chunk + 1) * chunk_size);
+
+	out.clear();
+	readBatch(chunk * chunk_size, end, out, rings[id]);
+}
+
+// Read names[begin] to names[end - 1] through the ring, or one by one when
+// there is none or it failed. comm is read for every process, which costs
+// the ring far less than a second round for the kernel threads would.
+void Scanner::readBatch(size_t begin, size_t end, PidTable &out,
+		ProcUring *ring) {
+	static const char *const files[] = { "cmdline", "comm", "stat" };
+	static thread_local vector<const char *> batch;
+	static thread_local Pid p;
+
+	batch.clear();
+	for (size_t i = begin; i < end; ++i) {
+		batch.push_back(names[i].c_str());
+	}
+
+	uint64_t start = Metrics::now();
+	if (ring == NULL || ring->read(batch.data(), batch.size(), files, 3) == false) {
+		for (size_t i = 0; i < batch.size(); ++i) {
+			read(batch[i], out);
+		}
+		return;
+	}
+
+	// The reads of a batch are not timed apart, each process is charged
+	// an equal share
+	for (size_t i = 0; i < batch.size(); ++i) {
+		ProcUring::File &cmdline = ring->get(i, 0);
+		ProcUring::File &comm = ring->get(i, 1);
+		ProcUring::File &stat = ring->get(i, 2);
+		if (p.read(batch[i], cmdline.data, cmdline.length, comm.data,
+				comm.length, stat.data, stat.length)) {
+			out.append(p);
+		} else {
+			Metrics::count(Metrics::VANISHED);
+		}
+	}
+	uint64_t share = (Metrics::now() - start) / max(batch.size(), size_t(1));
+	for (size_t i = 0; i < batch.size(); ++i) {
+		Metrics::record(Metrics::PARSE, share);
+	}
+}
+
+// A process that exits between enumerate() and its read is left out. Each
+// thread reads into a Pid of its own that keeps its string buffers.
+void Scanner::read(const char *name, PidTable &out) {
+	static thread_local Pid p;
+	uint64_t start = Metrics::now();
+	p.read(name);
+	Metrics::record(Metrics::PARSE, Metrics::now() - start);
+	if (p.valid()) {
+		out.append(p);
+	} else {
+		Metrics::count(Metrics::VANISHED);
+	}
+}
+
+void Scanner::work(unsigned id) {
+	size_t chunk;
+
+	// Drain our own range first
+	while ((chunk = ranges[id].next.fetch_add(1)) < ranges[id].end) {
+		parseChunk(chunk, id);
+	}
+
+	// Then take what is left of everyone else's
+	for (unsigned n = 1; n < threads; ++n) {
+		Range &victim = ranges[(id + n) % threads];
+		while ((chunk = victim.next.fetch_add(1)) < victim.end) {
+			parseChunk(chunk, id);
+		}
+	}
+}
+
+void Scanner::worker(unsigned id) {
+	uint64_t seen = 0;
+
+	for (;;) {
+		{
+			unique_lock<mutex> guard(lock);
+			while (stopping == false && generation == seen) {
+				wake.wait(guard);
+			}
+			if (stopping) {
+				return;
+			}
+			seen = generation;
+		}
+
+		work(id);
+
+		unique_lock<mutex> guard(lock);
+		if (--running == 0) {
+			finished.notify_one();
+		}
+	}
+}
+
+void Scanner::scan(PidTable &pids) {
+	enumerate();
+	pids.clear();
+
+	if (threads == 1) {
+		for (size_t i = 0; i < names.size(); i += chunk_size) {
+			readBatch(i, min(names.size(), i + chunk_size), pids, rings[0]);
+		}
+		return;
+	}
+
+	size_t count = (names.size() + chunk_size - 1) / chunk_size;
+	// Chunk tables are kept across scans, with their buffers
+	if (chunks.size() < count) {
+		chunks.resize(count);
+	}
+	for (unsigned id = 0; id < threads; ++id) {
+		ranges[id].next = count * id / threads;
+		ranges[id].end = count * (id + 1) / threads;
+	}
+
+	{
+		unique_lock<mutex> guard(lock);
+		running = threads - 1;
+		generation++;
+	}
+	wake.notify_all();
+
+	work(0);
+
+	{
+		unique_lock<mutex> guard(lock);
+		while (running > 0) {
+			finished.wait(guard);
+		}
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		pids.append(chunks[i]);
+	}
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef SCANNER_H_
+#define SCANNER_H_
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "PidTable.h"
+#include "ProcUring.h"
+
+using namespace std;
+
+// Builds a snapshot of every process under the proc root. With more than
+// one thread the sorted PID list is cut into chunks, each worker owns a
+// contiguous range of chunks and, once its own range is drained, steals
+// chunks from the ranges of the others. Chunk results are concatenated in
+// chunk order, so the snapshot is in PID order either way. Where io_uring
+// is available each worker reads a chunk's files through a ring of its own.
+class Scanner {
+private:
+	struct Range {
+		atomic<size_t> next;
+		size_t end;
+	};
+
+	unsigned threads;
+	vector<thread> workers;
+	mutex lock;
+	condition_variable wake;
+	condition_variable finished;
+	uint64_t generation;
+	unsigned running;
+	bool stopping;
+
+	vector<string> names;
+	vector<PidTable> chunks;
+	Range *ranges;
+	vector<ProcUring *> rings;
+
+	void enumerate(void);
+	void parseChunk(size_t chunk, unsigned id);
+	void readBatch(size_t begin, size_t end, PidTable &out, ProcUring *ring);
+	static void read(const char *name, PidTable &out);
+	void work(unsigned id);
+	void worker(unsigned id);
+
+public:
+	Scanner(unsigned threads = 1);
+	virtual ~Scanner();
+	void scan(PidTable &pids);
+	unsigned getThreads(void);
+};
+
+#endif /* SCANNER_H_ */
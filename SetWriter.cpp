@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <stdlib.h>
+}
+
+#include <map>
+#include <utility>
+#include "SetWriter.h"
+#include "PidSchema.h"
+#include "Clock.h"
+#include "Cmdlines.h"
+
+// A timestamptz of the microseconds since 1970 in expression, exact where
+// to_timestamp() would go through a double
+static string timestamp(const string &microseconds) {
+	return "(TIMESTAMPTZ 'epoch' + INTERVAL '1 microsecond' * "
+			+ microseconds + ")";
+}
+
+bool SetWriter::store(Pgsql &db, const vector<const Snapshot *> &snapshots) {
+	if (snapshots.empty())
+		return true;
+
+	// $1 is the upload time, shared by every set of the batch
+	string query = "INSERT INTO pid_sets (nodename, node_time, upload_time, "
+			"kind) VALUES ";
+	vector<string> values;
+	values.push_back(to_string(Clock().nanoseconds() / 1000));
+	for (size_t i = 0; i < snapshots.size(); ++i) {
+		if (i > 0)
+			query += ", ";
+		query += "($" + to_string(2 * i + 2) + ", "
+				+ timestamp("$" + to_string(2 * i + 3) + "::int8") + ", "
+				+ timestamp("$1::int8") + ", 'K')";
+		values.push_back(snapshots[i]->nodename);
+		values.push_back(to_string(snapshots[i]->node_time / 1000));
+	}
+	query += " ON CONFLICT (nodename, node_time) DO NOTHING"
+			" RETURNING set_id, nodename,"
+			" round(extract(epoch FROM node_time) * 1000000)::bigint";
+
+	// Interned before the transaction, see Cmdlines::resolve()
+	vector<int64_t> cmdline_ids;
+	size_t first = 0;
+	if (Cmdlines::enabled()) {
+		vector<Delta::Row> all;
+		for (size_t i = 0; i < snapshots.size(); ++i) {
+			Delta::Row row = { 0, &snapshots[i]->pids, 0 };
+			for (; row.row < snapshots[i]->pids.size(); ++row.row)
+				all.push_back(row);
+		}
+		if (Cmdlines::resolve(db, all, cmdline_ids) == false)
+			return false;
+		first = PidSchema::after_cmdline;
+	}
+
+	db.begin();
+	PGresult *res = db.exec(query, values);
+	bool ok = res != NULL;
+
+	// Sets that were stored before get no row back
+	map<pair<string, int64_t>, uint64_t> set_ids;
+	if (ok) {
+		for (int i = 0; i < PQntuples(res); ++i) {
+			set_ids[make_pair(string(PQgetvalue(res, i, 1)),
+					int64_t(strtoll(PQgetvalue(res, i, 2), NULL, 10)))] =
+					strtoull(PQgetvalue(res, i, 0), NULL, 10);
+		}
+		PQclear(res);
+	}
+
+	if (ok && set_ids.empty() == false) {
+		Copy pid_copy = db.createCopy("pids");
+		pid_copy.addCol("set_id");
+		if (first > 0)
+			pid_copy.addCol("cmdline_id");
+		PidSchema::declare(pid_copy, first);
+		ok = pid_copy.begin();
+		size_t row = 0;
+		for (size_t i = 0; ok && i < snapshots.size(); ++i) {
+			size_t rows = snapshots[i]->pids.size();
+			// A snapshot sent twice in one batch is stored once
+			map<pair<string, int64_t>, uint64_t>::iterator set_id =
+					set_ids.find(make_pair(snapshots[i]->nodename,
+							snapshots[i]->node_time / 1000));
+			if (set_id == set_ids.end()) {
+				row += rows;
+				continue;
+			}
+			const PidTable &pids = snapshots[i]->pids;
+			for (size_t p = 0; p < pids.size(); ++p, ++row) {
+				pid_copy.add(set_id->second);
+				if (first > 0)
+					pid_copy.add(cmdline_ids[row]);
+				PidSchema::write(pid_copy, pids, p, first);
+				pid_copy.endRow();
+			}
+			set_ids.erase(set_id);
+		}
+		if (ok)
+			ok = pid_copy.end();
+	}
+
+	ok = db.commit() && ok;
+	if (ok == false && first > 0)
+		Cmdlines::clear();
+	return ok;
+}
+
+// One set as the collector takes it, under a set_id reserved by
+// Pgsql::nextSetId(), so nothing waits for the pid_sets row before the
+// processes are sent. A keyframe's processes go to pids and a delta's
+// changes to pid_deltas, by COPY or by one prepared INSERT per row. For
+// COPY, BEGIN and the pid_sets row go in the message that starts it; for
+// INSERT they are the first statements of the pipeline.
+bool SetWriter::write(Pgsql &db, const string &nodename, const Clock &node_time,
+		bool keyframe, const vector<Delta::Row> &rows, Method method) {
+	vector<int64_t> cmdline_ids;
+	size_t first = 0;
+	if (Cmdlines::enabled()) {
+		if (Cmdlines::resolve(db, rows, cmdline_ids) == false)
+			return false;
+		first = PidSchema::after_cmdline;
+	}
+
+	// Without an id the set is not stored at all
+	uint64_t set_id;
+	if (db.nextSetId(set_id) == false)
+		return false;
+
+	Clock upload_time;
+	bool stored = true;
+	if (method != INSERT) {
+		string header = "BEGIN; INSERT INTO pid_sets (set_id, nodename, "
+				"node_time, upload_time, kind) VALUES (" + to_string(set_id)
+				+ ", " + db.literal(nodename) + ", "
+				+ timestamp(to_string(node_time.nanoseconds() / 1000)) + ", "
+				+ timestamp(to_string(upload_time.nanoseconds() / 1000))
+				+ ", '" + (keyframe ? 'K' : 'D') + "')";
+
+		Copy pid_copy = db.createCopy(keyframe ? "pids" : "pid_deltas");
+		if (method == COPY_TEXT) {
+			pid_copy.setFormat(Copy::TEXT);
+		}
+		pid_copy.addCol("set_id");
+		if (first > 0) {
+			pid_copy.addCol("cmdline_id");
+		}
+		PidSchema::declare(pid_copy, first);
+		if (keyframe == false) {
+			pid_copy.addCol("change");
+		}
+
+		stored = pid_copy.begin(header);
+		if (stored) {
+			for (size_t i = 0; i < rows.size(); ++i) {
+				pid_copy.add(set_id);
+				if (first > 0) {
+					pid_copy.add(cmdline_ids[i]);
+				}
+				PidSchema::write(pid_copy, *rows[i].table, rows[i].row, first);
+				if (keyframe == false) {
+					pid_copy.add(rows[i].change);
+				}
+				pid_copy.endRow();
+			}
+			stored = pid_copy.end();
+		}
+	} else {
+		db.begin();
+		Prepare pid_sets_insert = db.createPrepare("pid_sets_insert");
+		pid_sets_insert.setTableName("pid_sets");
+		pid_sets_insert.addCol("set_id", set_id);
+		pid_sets_insert.addCol("nodename", nodename);
+		pid_sets_insert.addCol("node_time", node_time);
+		pid_sets_insert.addCol("upload_time", upload_time);
+		pid_sets_insert.addCol("kind", keyframe ? 'K' : 'D');
+		pid_sets_insert.exec();
+
+		// One Prepare for all rows, so its parameter buffers are reused
+		Prepare pid_insert = db.createPrepare(keyframe ? "pid_insert" : "pid_delta_insert");
+		pid_insert.setTableName(keyframe ? "pids" : "pid_deltas");
+		pid_insert.declareCol("set_id", INT8OID);
+		if (first > 0) {
+			pid_insert.declareCol("cmdline_id", INT8OID);
+		}
+		PidSchema::declare(pid_insert, first);
+		if (keyframe == false) {
+			pid_insert.declareCol("change", CHAROID);
+		}
+
+		for (size_t i = 0; i < rows.size(); ++i) {
+			pid_insert.add(int64_t(set_id));
+			if (first > 0) {
+				pid_insert.add(cmdline_ids[i]);
+			}
+			PidSchema::write(pid_insert, *rows[i].table, rows[i].row, first);
+			if (keyframe == false) {
+				pid_insert.add(rows[i].change);
+			}
+			pid_insert.exec();
+		}
+	}
+
+	stored = db.commit() && stored;
+	if (stored == false && first > 0) {
+		Cmdlines::clear();
+	}
+	return stored;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef SETWRITER_H_
+#define SETWRITER_H_
+
+#include <vector>
+#include "Pgsql.h"
+#include "Snapshot.h"
+#include "Delta.h"
+
+using namespace std;
+
+class Clock;
+
+// Stores whole snapshots as keyframe sets, any number of them, from any
+// nodes, in one transaction: one INSERT adds their pid_sets rows and one
+// COPY all of their processes. A snapshot whose (nodename, node_time) is
+// already in pid_sets was stored before and is skipped, so storing a
+// snapshot again does no harm.
+class SetWriter {
+public:
+	enum Method {
+		COPY, COPY_TEXT, INSERT
+	};
+
+	static bool store(Pgsql &db, const vector<const Snapshot *> &snapshots);
+	static bool write(Pgsql &db, const string &nodename, const Clock &node_time,
+			bool keyframe, const vector<Delta::Row> &rows, Method method);
+};
+
+#endif /* SETWRITER_H_ */
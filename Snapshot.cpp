@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <string.h>
+#include <endian.h>
+}
+
+#include "Snapshot.h"
+#include "PidSchema.h"
+
+static const char snapshot_magic[4] = { 'P', 'I', 'D', 'S' };
+// Version 1 held node_time in seconds
+static const uint8_t snapshot_version = 2;
+
+SnapshotWriter::SnapshotWriter(string &out) :
+		out(out) {
+}
+
+void SnapshotWriter::add(int32_t value) {
+	uint32_t n = htobe32(value);
+	out.append(reinterpret_cast<const char *>(&n), sizeof(n));
+}
+
+void SnapshotWriter::add(int64_t value) {
+	uint64_t n = htobe64(value);
+	out.append(reinterpret_cast<const char *>(&n), sizeof(n));
+}
+
+void SnapshotWriter::add(char value) {
+	out.push_back(value);
+}
+
+void SnapshotWriter::add(const string &value) {
+	add(value.data(), value.length());
+}
+
+void SnapshotWriter::add(const char *value, size_t length) {
+	add(int32_t(length));
+	out.append(value, length);
+}
+
+SnapshotReader::SnapshotReader(const char *data, size_t length) :
+		p(data), end(data + length), failed(false) {
+}
+
+bool SnapshotReader::take(void *value, size_t length) {
+	if (failed || size_t(end - p) < length) {
+		failed = true;
+		memset(value, 0, length);
+		return false;
+	}
+	memcpy(value, p, length);
+	p += length;
+	return true;
+}
+
+void SnapshotReader::get(int32_t &value) {
+	uint32_t n;
+	take(&n, sizeof(n));
+	value = be32toh(n);
+}
+
+void SnapshotReader::get(int64_t &value) {
+	uint64_t n;
+	take(&n, sizeof(n));
+	value = be64toh(n);
+}
+
+void SnapshotReader::get(char &value) {
+	take(&value, sizeof(value));
+}
+
+void SnapshotReader::get(string &value) {
+	const char *data;
+	size_t length;
+	get(data, length);
+	value.assign(data, length);
+}
+
+// The value is left in the record, data points into it
+void SnapshotReader::get(const char *&value, size_t &length) {
+	int32_t n;
+	get(n);
+	if (failed || n < 0 || size_t(end - p) < size_t(n)) {
+		failed = true;
+		value = p;
+		length = 0;
+		return;
+	}
+	value = p;
+	length = n;
+	p += n;
+}
+
+bool SnapshotReader::ok(void) const {
+	return failed == false;
+}
+
+size_t SnapshotReader::remaining(void) const {
+	return end - p;
+}
+
+Snapshot::Snapshot() :
+		node_time(0) {
+}
+
+Snapshot::Snapshot(const string &nodename, int64_t node_time) :
+		nodename(nodename), node_time(node_time) {
+}
+
+Snapshot::~Snapshot() {
+}
+
+void Snapshot::encode(string &out) const {
+	encode(out, nodename, node_time, pids);
+}
+
+// Lets a caller encode the processes it holds without copying them
+void Snapshot::encode(string &out, const string &nodename, int64_t node_time,
+		const PidTable &pids) {
+	SnapshotWriter w(out);
+	out.append(snapshot_magic, sizeof(snapshot_magic));
+	w.add(char(snapshot_version));
+	w.add(int32_t(PidSchema::count));
+	w.add(nodename);
+	w.add(node_time);
+	w.add(int32_t(pids.size()));
+	for (size_t row = 0; row < pids.size(); ++row)
+		PidSchema::write(w, pids, row);
+}
+
+bool Snapshot::decode(const char *data, size_t length) {
+	pids.clear();
+	if (length < sizeof(snapshot_magic)
+			|| memcmp(data, snapshot_magic, sizeof(snapshot_magic)) != 0)
+		return false;
+
+	SnapshotReader r(data + sizeof(snapshot_magic),
+			length - sizeof(snapshot_magic));
+	char version;
+	int32_t columns, count;
+	int64_t nanoseconds;
+	r.get(version);
+	r.get(columns);
+	if (r.ok() == false || version != snapshot_version
+			|| columns != int32_t(PidSchema::count))
+		return false;
+
+	r.get(nodename);
+	r.get(nanoseconds);
+	r.get(count);
+	if (r.ok() == false || count < 0)
+		return false;
+	node_time = nanoseconds;
+
+	// Each process takes at least one byte per column
+	if (size_t(count) > r.remaining() / PidSchema::count)
+		return false;
+	bool ok = true;
+	for (int32_t i = 0; ok && i < count; ++i)
+		ok = PidSchema::decode(r, pids);
+
+	if (ok == false || r.remaining() != 0) {
+		pids.clear();
+		return false;
+	}
+	return true;
+}
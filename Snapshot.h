@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+extern "C" {
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+}
+
+#include <string>
+#include <vector>
+#include "PidTable.h"
+
+using namespace std;
+
+// Appends values in network byte order, the way PidSchema hands them out
+class SnapshotWriter {
+private:
+	string &out;
+public:
+	SnapshotWriter(string &out);
+	void add(int32_t value);
+	void add(int64_t value);
+	void add(char value);
+	void add(const string &value);
+	void add(const char *value, size_t length);
+};
+
+// Reads values back in the order they were written. Reading past the end
+// leaves the value zero or empty and marks the reader failed.
+class SnapshotReader {
+private:
+	const char *p;
+	const char *end;
+	bool failed;
+	bool take(void *value, size_t length);
+public:
+	SnapshotReader(const char *data, size_t length);
+	void get(int32_t &value);
+	void get(int64_t &value);
+	void get(char &value);
+	void get(string &value);
+	void get(const char *&value, size_t &length);
+	bool ok(void) const;
+	size_t remaining(void) const;
+};
+
+// The processes of a node at one point in time, in a self-contained binary
+// form that is kept in the spool and decoded into a PidTable again when it is
+// stored. Records carry the PidSchema column count, so a record written
+// with a different column table is refused rather than misread.
+class Snapshot {
+public:
+	string nodename;
+	int64_t node_time;	// nanoseconds since 1970-01-01 UTC
+	PidTable pids;
+
+	Snapshot();
+	Snapshot(const string &nodename, int64_t node_time);
+	virtual ~Snapshot();
+	void encode(string &out) const;
+	bool decode(const char *data, size_t length);
+	static void encode(string &out, const string &nodename, int64_t node_time,
+			const PidTable &pids);
+};
+
+#endif /* SNAPSHOT_H_ */
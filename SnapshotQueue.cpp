@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <algorithm>
+#include "SnapshotQueue.h"
+#include "Metrics.h"
+
+SnapshotQueue::SnapshotQueue(size_t capacity, Policy policy) :
+		policy(policy), capacity(max(capacity, size_t(1))), queued(NULL),
+		head(0), tail(0), released_head(0), released_tail(0), popped(0),
+		closed(false) {
+	// One slot for each place in the queue, one being filled by the
+	// collector and one being stored by the writer
+	slots.resize(this->capacity + 2);
+	queued = new atomic<Slot *>[this->capacity];
+	released.resize(slots.size());
+
+	spare = &slots[0];
+	for (size_t i = 1; i < slots.size(); ++i) {
+		released[released_tail++] = &slots[i];
+	}
+}
+
+SnapshotQueue::~SnapshotQueue() {
+	delete[] queued;
+}
+
+SnapshotQueue::Policy SnapshotQueue::getPolicy(void) const {
+	return policy;
+}
+
+// Snapshots waiting for the writer
+size_t SnapshotQueue::depth(void) const {
+	return tail.load(memory_order_acquire) - head.load(memory_order_acquire);
+}
+
+void SnapshotQueue::notify(void) {
+	{
+		lock_guard<mutex> guard(lock);
+	}
+	changed.notify_all();
+}
+
+// The slot for the collector to fill next
+SnapshotQueue::Slot &SnapshotQueue::next(void) {
+	return *spare;
+}
+
+// Queue the slot from next(). Depending on the policy a full queue makes
+// this wait for the writer or gives up the oldest queued snapshot.
+void SnapshotQueue::push(void) {
+	uint64_t t = tail.load(memory_order_relaxed);
+	Slot *reclaimed = NULL;
+	for (;;) {
+		uint64_t h = head.load(memory_order_acquire);
+		if (t - h < capacity)
+			break;
+
+		if (policy == BLOCK) {
+			unique_lock<mutex> guard(lock);
+			while (t - head.load(memory_order_acquire) >= capacity) {
+				changed.wait(guard);
+			}
+			continue;
+		}
+
+		// The writer may take the oldest at the same moment, then the
+		// next one is tried
+		Slot *oldest = queued[h % capacity].load(memory_order_acquire);
+		if (head.compare_exchange_strong(h, h + 1, memory_order_acq_rel)) {
+			reclaimed = oldest;
+			Metrics::count(policy == COALESCE ?
+					Metrics::QUEUE_COALESCED : Metrics::QUEUE_DROPPED);
+			break;
+		}
+	}
+
+	queued[t % capacity].store(spare, memory_order_release);
+	tail.store(t + 1, memory_order_release);
+	Metrics::set(Metrics::QUEUE_DEPTH, depth());
+
+	// There is always a released slot when none was reclaimed: only the
+	// queue and the writer's slot hold any others
+	if (reclaimed != NULL) {
+		spare = reclaimed;
+	} else {
+		uint64_t r = released_head.load(memory_order_relaxed);
+		while (released_tail.load(memory_order_acquire) == r) {
+			this_thread::yield();
+		}
+		spare = released[r % released.size()];
+		released_head.store(r + 1, memory_order_release);
+	}
+
+	notify();
+}
+
+// No more snapshots will come; pop() returns NULL once the queue is empty
+void SnapshotQueue::close(void) {
+	{
+		lock_guard<mutex> guard(lock);
+		closed = true;
+	}
+	changed.notify_all();
+}
+
+// The oldest queued snapshot, waiting for one if there is none. Its
+// dropped is the number of snapshots given up right before it.
+SnapshotQueue::Slot *SnapshotQueue::pop(void) {
+	for (;;) {
+		uint64_t h = head.load(memory_order_acquire);
+		if (h == tail.load(memory_order_acquire)) {
+			unique_lock<mutex> guard(lock);
+			while (closed == false && head.load(memory_order_acquire)
+					== tail.load(memory_order_acquire)) {
+				changed.wait(guard);
+			}
+			if (closed && head.load(memory_order_acquire)
+					== tail.load(memory_order_acquire)) {
+				return NULL;
+			}
+			continue;
+		}
+
+		Slot *slot = queued[h % capacity].load(memory_order_acquire);
+		if (head.compare_exchange_strong(h, h + 1, memory_order_acq_rel)) {
+			slot->dropped = h - popped;
+			popped = h + 1;
+			Metrics::set(Metrics::QUEUE_DEPTH, depth());
+			notify();
+			return slot;
+		}
+	}
+}
+
+// Sleep until the CLOCK_MONOTONIC time until, which steady_clock is on
+// Linux. Returns false early when the queue is closed, so what is left is
+// stored without waiting out the schedule.
+bool SnapshotQueue::hold(uint64_t until) {
+	chrono::steady_clock::time_point deadline(
+			chrono::duration_cast<chrono::steady_clock::duration>(
+					chrono::nanoseconds(until)));
+	unique_lock<mutex> guard(lock);
+	while (closed == false && chrono::steady_clock::now() < deadline) {
+		changed.wait_until(guard, deadline);
+	}
+	return closed == false;
+}
+
+// Give a slot from pop() back once it is stored
+void SnapshotQueue::release(Slot *slot) {
+	uint64_t r = released_tail.load(memory_order_relaxed);
+	released[r % released.size()] = slot;
+	released_tail.store(r + 1, memory_order_release);
+}
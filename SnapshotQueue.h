@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef SNAPSHOTQUEUE_H_
+#define SNAPSHOTQUEUE_H_
+
+extern "C" {
+#include <stdint.h>
+#include <time.h>
+}
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+
+#include "PidTable.h"
+#include "Clock.h"
+
+using namespace std;
+
+// Hands snapshots from the collector thread to the writer thread. Slots
+// are allocated once and passed around by pointer: the collector fills
+// its spare slot and pushes it, the writer pops one, stores it and
+// releases it, and released slots come back to the collector as spares.
+// Their tables keep their capacity from round to round.
+//
+// The queue and the return path are rings of slot pointers indexed by
+// atomic counters. When the queue is full the collector either waits
+// (BLOCK) or takes the oldest queued slot for itself (DROP_OLDEST,
+// COALESCE); it and the writer then race for that slot with a
+// compare-and-swap on the head counter. The mutex and condition variable
+// are only there to sleep on an empty or, with BLOCK, a full queue.
+class SnapshotQueue {
+public:
+	enum Policy {
+		BLOCK, DROP_OLDEST, COALESCE
+	};
+
+	struct Slot {
+		PidTable pids;
+		// When the scan started
+		Clock node_time;
+		// Snapshots that were dropped right before this one
+		uint64_t dropped;
+	};
+
+private:
+	Policy policy;
+	size_t capacity;
+	vector<Slot> slots;
+	atomic<Slot *> *queued;
+	atomic<uint64_t> head;
+	atomic<uint64_t> tail;
+	vector<Slot *> released;
+	atomic<uint64_t> released_head;
+	atomic<uint64_t> released_tail;
+	// The collector's slot, and the writer's count of what it popped
+	Slot *spare;
+	uint64_t popped;
+	bool closed;
+	mutex lock;
+	condition_variable changed;
+
+	void notify(void);
+
+public:
+	SnapshotQueue(size_t capacity, Policy policy);
+	virtual ~SnapshotQueue();
+	Policy getPolicy(void) const;
+	size_t depth(void) const;
+
+	// Collector side
+	Slot &next(void);
+	void push(void);
+	void close(void);
+
+	// Writer side
+	Slot *pop(void);
+	bool hold(uint64_t until);
+	void release(Slot *slot);
+};
+
+#endif /* SNAPSHOTQUEUE_H_ */
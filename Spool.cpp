@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+}
+
+#include <iostream>
+#include "Spool.h"
+
+// Records start after the header page and are 8 byte aligned. The records
+// between head and tail may wrap: when a record does not fit before the
+// end of the file it goes to the start of the data area, and wrap
+// holds the end of the records above it until head catches up.
+static const size_t spool_data = 4096;
+static const char spool_magic[8] = { 'P', 'I', 'D', 'S', 'P', 'O', 'O', 'L' };
+static const uint32_t spool_version = 1;
+
+Spool::Spool() :
+		fd(-1), map(NULL), capacity(0), header(NULL), dropped(0) {
+}
+
+Spool::~Spool() {
+	close();
+}
+
+size_t Spool::recordSize(size_t length) {
+	return (sizeof(Record) + length + 7) & ~size_t(7);
+}
+
+// FNV-1a, enough to tell a torn write from a complete record
+uint32_t Spool::checksum(const char *data, size_t length) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; ++i) {
+		hash ^= uint8_t(data[i]);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+void Spool::sync(size_t offset, size_t length) {
+	size_t start = offset & ~(spool_data - 1);
+	if (msync(map + start, offset + length - start, MS_SYNC) == -1)
+		perror("msync");
+}
+
+bool Spool::open(const string &path, size_t capacity) {
+	close();
+	this->path = path;
+	capacity = (capacity + spool_data - 1) & ~(spool_data - 1);
+	if (capacity < 2 * spool_data) {
+		cerr << "Spool size must be at least " << 2 * spool_data << " bytes"
+				<< endl;
+		return false;
+	}
+
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		perror(path.c_str());
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		perror(path.c_str());
+		close();
+		return false;
+	}
+
+	// A spool that still holds records keeps its size, records are never
+	// moved to fit a new one
+	Header existing;
+	bool valid = size_t(st.st_size) >= 2 * spool_data
+			&& pread(fd, &existing, sizeof(existing), 0) == sizeof(existing)
+			&& memcmp(existing.magic, spool_magic, sizeof(spool_magic)) == 0
+			&& existing.version == spool_version;
+	if (valid && existing.records > 0 && size_t(st.st_size) != capacity) {
+		cerr << path << " holds " << existing.records
+				<< " snapshots, keeping its size of " << st.st_size << " bytes"
+				<< endl;
+		capacity = st.st_size;
+	}
+
+	if (size_t(st.st_size) != capacity && ftruncate(fd, capacity) == -1) {
+		perror(path.c_str());
+		close();
+		return false;
+	}
+
+	void *m = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED) {
+		perror(path.c_str());
+		close();
+		return false;
+	}
+	map = static_cast<char *>(m);
+	header = reinterpret_cast<Header *>(map);
+	this->capacity = capacity;
+
+	if (valid) {
+		recover();
+	} else {
+		initialize();
+	}
+	return true;
+}
+
+void Spool::close(void) {
+	if (map != NULL) {
+		munmap(map, capacity);
+		map = NULL;
+		header = NULL;
+	}
+	if (fd != -1) {
+		::close(fd);
+		fd = -1;
+	}
+}
+
+void Spool::initialize(void) {
+	memset(header, 0, sizeof(Header));
+	memcpy(header->magic, spool_magic, sizeof(spool_magic));
+	header->version = spool_version;
+	header->head = spool_data;
+	header->tail = spool_data;
+	sync(0, sizeof(Header));
+}
+
+// Walk the records from head and keep those up to the first one that is
+// cut off or does not match its checksum
+void Spool::recover(void) {
+	Header &h = *header;
+	bool wrapped = h.wrap != 0;
+	if (h.head < spool_data || h.head > capacity || h.tail < spool_data
+			|| h.tail > capacity || (wrapped == false && h.head > h.tail)
+			|| (wrapped && (h.wrap > capacity || h.tail > h.head))) {
+		cerr << path << " has a damaged header, starting an empty spool"
+				<< endl;
+		initialize();
+		return;
+	}
+
+	uint64_t offset = h.head;
+	uint64_t end = wrapped ? h.wrap : h.tail;
+	uint64_t records = 0;
+	while (true) {
+		if (offset == end) {
+			if (wrapped == false || end == h.tail)
+				break;
+			offset = spool_data;
+			end = h.tail;
+			continue;
+		}
+
+		Record r;
+		if (end - offset < sizeof(Record))
+			break;
+		memcpy(&r, map + offset, sizeof(r));
+		size_t size = recordSize(r.length);
+		if (size > end - offset
+				|| checksum(map + offset + sizeof(Record), r.length)
+						!= r.checksum)
+			break;
+		offset += size;
+		++records;
+	}
+
+	if (offset != end || records != h.records) {
+		cerr << path << ": keeping " << records << " of " << h.records
+				<< " snapshots, the rest were not written completely" << endl;
+		if (wrapped && end != h.tail) {
+			// Broke off above the wrap, everything after it is gone
+			h.wrap = 0;
+		}
+		h.tail = offset;
+		h.records = records;
+		if (records == 0) {
+			h.head = h.tail = spool_data;
+			h.wrap = 0;
+		}
+		sync(0, sizeof(Header));
+	}
+}
+
+void Spool::dropOldest(void) {
+	Header &h = *header;
+	Record r;
+	memcpy(&r, map + h.head, sizeof(r));
+	h.head += recordSize(r.length);
+	if (h.wrap != 0 && h.head == h.wrap) {
+		h.head = spool_data;
+		h.wrap = 0;
+	}
+	++h.head_seq;
+	if (--h.records == 0) {
+		h.head = h.tail = spool_data;
+		h.wrap = 0;
+	}
+}
+
+bool Spool::append(const string &record) {
+	size_t need = recordSize(record.length());
+	if (header == NULL || need > capacity - spool_data) {
+		cerr << "Snapshot of " << record.length()
+				<< " bytes does not fit in the spool" << endl;
+		return false;
+	}
+
+	lock_guard<mutex> guard(lock);
+	Header &h = *header;
+	uint64_t lost = 0;
+	uint64_t offset;
+	while (true) {
+		if (h.records == 0) {
+			h.head = h.tail = spool_data;
+			h.wrap = 0;
+		}
+		if (h.wrap == 0 && h.tail + need <= capacity) {
+			offset = h.tail;
+			break;
+		}
+		if (h.wrap == 0 && spool_data + need <= h.head) {
+			offset = spool_data;
+			break;
+		}
+		if (h.wrap != 0 && h.tail + need <= h.head) {
+			offset = h.tail;
+			break;
+		}
+		dropOldest();
+		++lost;
+	}
+
+	// The dropped records are overwritten next, so the header must stop
+	// naming them on disk first
+	if (lost > 0)
+		sync(0, sizeof(Header));
+
+	Record r;
+	r.length = record.length();
+	r.checksum = checksum(record.data(), record.length());
+	memcpy(map + offset, &r, sizeof(r));
+	memcpy(map + offset + sizeof(r), record.data(), record.length());
+	sync(offset, need);
+
+	// The record is complete on disk before the header points past it
+	if (h.wrap == 0 && offset == spool_data && h.tail != spool_data)
+		h.wrap = h.tail;
+	h.tail = offset + need;
+	++h.records;
+	sync(0, sizeof(Header));
+
+	if (lost > 0) {
+		dropped += lost;
+		cerr << "Spool is full, dropped the " << lost << " oldest snapshots"
+				<< endl;
+	}
+	return true;
+}
+
+// Copy out up to max of the oldest records and return the sequence number
+// of the first one
+uint64_t Spool::front(vector<string> &records, size_t max) {
+	lock_guard<mutex> guard(lock);
+	records.clear();
+	if (header == NULL)
+		return 0;
+
+	const Header &h = *header;
+	uint64_t offset = h.head;
+	for (uint64_t i = 0; i < h.records && records.size() < max; ++i) {
+		if (h.wrap != 0 && offset == h.wrap)
+			offset = spool_data;
+		Record r;
+		memcpy(&r, map + offset, sizeof(r));
+		records.push_back(string(map + offset + sizeof(r), r.length));
+		offset += recordSize(r.length);
+	}
+	return h.head_seq;
+}
+
+// Remove the records before next_seq. Records the writer already dropped
+// are skipped.
+void Spool::pop(uint64_t next_seq) {
+	lock_guard<mutex> guard(lock);
+	if (header == NULL)
+		return;
+
+	bool changed = false;
+	while (header->records > 0 && header->head_seq < next_seq) {
+		dropOldest();
+		changed = true;
+	}
+	if (changed)
+		sync(0, sizeof(Header));
+}
+
+size_t Spool::size(void) {
+	lock_guard<mutex> guard(lock);
+	return header == NULL ? 0 : header->records;
+}
+
+bool Spool::empty(void) {
+	return size() == 0;
+}
+
+uint64_t Spool::getDropped(void) {
+	lock_guard<mutex> guard(lock);
+	return dropped;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef SPOOL_H_
+#define SPOOL_H_
+
+extern "C" {
+#include <stdint.h>
+#include <stddef.h>
+}
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+using namespace std;
+
+// Append-only queue of encoded snapshots in one memory-mapped segment file
+// of fixed size, kept while the database cannot be reached. Records are
+// appended at the tail and taken off the head once they are stored. Each
+// record has a sequence number, so the reader knows which records it took
+// even when the writer had to drop the oldest ones to stay within the
+// size. A record only counts once it is written and synced, and open()
+// cuts off a torn or damaged record left by a crash, with all after it.
+class Spool {
+private:
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t reserved;
+		uint64_t head;
+		uint64_t tail;
+		uint64_t head_seq;
+		uint64_t records;
+		uint64_t wrap;
+	};
+
+	struct Record {
+		uint32_t length;
+		uint32_t checksum;
+	};
+
+	string path;
+	int fd;
+	char *map;
+	size_t capacity;
+	Header *header;
+	mutex lock;
+	uint64_t dropped;
+
+	static size_t recordSize(size_t length);
+	static uint32_t checksum(const char *data, size_t length);
+	void initialize(void);
+	void recover(void);
+	void dropOldest(void);
+	void sync(size_t offset, size_t length);
+
+public:
+	Spool();
+	virtual ~Spool();
+	bool open(const string &path, size_t capacity);
+	void close(void);
+	bool append(const string &record);
+	uint64_t front(vector<string> &records, size_t max);
+	void pop(uint64_t next_seq);
+	size_t size(void);
+	bool empty(void);
+	uint64_t getDropped(void);
+};
+
+#endif /* SPOOL_H_ */
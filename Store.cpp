@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+}
+
+#include <iostream>
+#include <algorithm>
+#include "Store.h"
+#include "Metrics.h"
+#include "Clock.h"
+
+Store::Store(SnapshotQueue &queue, const StoreTargets &targets) :
+		queue(queue), targets(targets), delta(NULL), piddb(NULL),
+		since_stats(0), share(0), latency(0), fastest(0) {
+	// FNV-1a of the node name
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < targets.nodename.size(); ++i) {
+		hash ^= uint8_t(targets.nodename[i]);
+		hash *= 16777619u;
+	}
+	share = hash / 4294967296.0;
+
+	if (targets.keyframe_interval > 0) {
+		delta = new Delta(targets.keyframe_interval);
+	}
+	worker = thread(&Store::run, this);
+}
+
+Store::~Store() {
+	finish();
+	delete piddb;
+	delete delta;
+}
+
+// Store what is queued and stop; the queue must be closed first
+void Store::finish(void) {
+	if (worker.joinable())
+		worker.join();
+}
+
+void Store::run(void) {
+	// Stop signals are for the sampling loop
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	SnapshotQueue::Slot *slot;
+	while ((slot = queue.pop()) != NULL) {
+		if (targets.spread > 0) {
+			uint64_t width = window();
+			Metrics::set(Metrics::UPLOAD_WINDOW, width / 1000000);
+			queue.hold(slot->node_time.getMonotonic()
+					+ uint64_t(share * width));
+		}
+		store(*slot);
+		queue.release(slot);
+	}
+}
+
+// The spread window in nanoseconds. While sets take more than twice as
+// long to store as the fastest one did, it widens in proportion, up to
+// spread_max, so a fleet backs off from a database that is falling behind.
+uint64_t Store::window(void) {
+	double width = targets.spread;
+	if (targets.spread_max > targets.spread && latency > 2 * fastest) {
+		width = min(double(targets.spread_max),
+				width * latency / (2 * fastest));
+	}
+	return uint64_t(width * 1000000);
+}
+
+// The fastest store creeps up by a percent a set, so sets that stay
+// larger are not taken for a slow database forever
+void Store::measured(uint64_t nanoseconds) {
+	if (fastest == 0) {
+		latency = fastest = nanoseconds;
+		return;
+	}
+	latency += (double(nanoseconds) - latency) / 8;
+	fastest = min(double(nanoseconds), fastest * 1.01);
+}
+
+void Store::store(SnapshotQueue::Slot &slot) {
+	if (delta != NULL && slot.dropped > 0
+			&& queue.getPolicy() != SnapshotQueue::COALESCE) {
+		delta->reset();
+	}
+
+	bool stored = write(slot);
+
+	if (delta != NULL) {
+		if (stored) {
+			delta->advance(slot.pids);
+		} else {
+			delta->reset();
+		}
+	}
+
+	if (stored == false) {
+		if (targets.spool != NULL) {
+			string record;
+			Snapshot::encode(record, targets.nodename,
+					slot.node_time.nanoseconds(), slot.pids);
+			if (targets.spool->append(record)) {
+				targets.replay->notify();
+			} else {
+				cerr << "Snapshot dropped." << endl;
+			}
+		} else {
+			cerr << "Snapshot dropped." << endl;
+		}
+	}
+
+	if (targets.stats_interval > 0 && piddb != NULL
+			&& ++since_stats >= targets.stats_interval && piddb->connected()) {
+		try {
+			if (Metrics::store(*piddb, targets.nodename, slot.node_time)) {
+				since_stats = 0;
+			}
+		} catch(Pgsql::Error *e) {
+			delete e;
+		}
+	}
+}
+
+// While older snapshots wait in the spool, new ones queue behind them
+bool Store::write(SnapshotQueue::Slot &slot) {
+	bool queued = targets.spool != NULL && targets.spool->empty() == false;
+	if (targets.recording != NULL) {
+		string record;
+		Snapshot::encode(record, targets.nodename,
+				slot.node_time.nanoseconds(), slot.pids);
+		return targets.recording->append(record);
+	}
+	if (queued) {
+		return false;
+	}
+	if (targets.uplink != NULL) {
+		string record;
+		Snapshot::encode(record, targets.nodename,
+				slot.node_time.nanoseconds(), slot.pids);
+		RelayClient::Status status = targets.uplink->send(record);
+		if (status == RelayClient::REFUSED) {
+			cerr << "The relay refused the snapshot." << endl;
+		}
+		return status != RelayClient::FAILED;
+	}
+
+	try {
+		// One connection, and its prepared statements, serve every set
+		if (piddb == NULL) {
+			piddb = new Pgsql(targets.dbhost.c_str(), targets.dbname.c_str(),
+					targets.dbuser.c_str(), targets.dbpass.c_str(),
+					targets.debug);
+			if (targets.pipeline == false) {
+				piddb->disablePipeline();
+			}
+		} else if (piddb->connected() == false && piddb->reconnect() == false) {
+			throw new Pgsql::Error();
+		}
+
+		// Keyframes go to pids in full, other sets only send changes
+		bool keyframe = delta == NULL || delta->compute(slot.pids, rows);
+		if (keyframe) {
+			rows.resize(slot.pids.size());
+			for (size_t i = 0; i < slot.pids.size(); ++i) {
+				rows[i].change = 0;
+				rows[i].table = &slot.pids;
+				rows[i].row = i;
+			}
+		}
+
+		uint64_t start = Metrics::now();
+		bool stored = SetWriter::write(*piddb, targets.nodename,
+				slot.node_time, keyframe, rows, targets.method);
+		if (stored) {
+			measured(Metrics::now() - start);
+		}
+		return stored;
+	} catch(Pgsql::Error *e) {
+		delete e;
+		cerr << "Unable to reach the database." << endl;
+		return false;
+	} catch(...) {
+		cerr << "Unknown Exception caught." << endl;
+		abort();
+	}
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef STORE_H_
+#define STORE_H_
+
+extern "C" {
+#include <stdint.h>
+}
+
+#include <string>
+#include <vector>
+#include <thread>
+
+#include "SnapshotQueue.h"
+#include "SetWriter.h"
+#include "Delta.h"
+#include "Pgsql.h"
+#include "Spool.h"
+#include "Replay.h"
+#include "Relay.h"
+#include "Recording.h"
+
+using namespace std;
+
+// Where a snapshot goes once it is taken, and the settings for getting it
+// there. Only the destinations in use are set.
+struct StoreTargets {
+	string dbhost;
+	string dbname;
+	string dbuser;
+	string dbpass;
+	string nodename;
+	bool debug;
+	bool pipeline;
+	SetWriter::Method method;
+	unsigned keyframe_interval;
+	unsigned stats_interval;
+	// Milliseconds after each snapshot over which uploads are spread, and
+	// how far the window may widen while the database is slow
+	unsigned spread;
+	unsigned spread_max;
+	Spool *spool;
+	Replay *replay;
+	RelayClient *uplink;
+	Recording *recording;
+};
+
+// Stores the snapshots the collector queues, from a thread of its own, so
+// a slow or unreachable database never holds up the next sample. Each one
+// is written to the recording, sent to the relay or stored as a set, and
+// goes to the spool when that fails, in the order they were taken. With
+// --delta, a drop from the queue makes the next set a keyframe; coalesced
+// snapshots are folded into the next delta instead.
+//
+// With a spread, each snapshot waits for the same share of the window
+// after it was taken, one set by a hash of the node name, so a fleet that
+// samples at the same moments does not store at the same moment too.
+class Store {
+private:
+	SnapshotQueue &queue;
+	StoreTargets targets;
+	Delta *delta;
+	Pgsql *piddb;
+	vector<Delta::Row> rows;
+	unsigned since_stats;
+	double share;		// of the spread window, 0 to 1
+	double latency;		// moving average of a set's store, nanoseconds
+	double fastest;
+	thread worker;
+
+	void run(void);
+	void store(SnapshotQueue::Slot &slot);
+	bool write(SnapshotQueue::Slot &slot);
+	uint64_t window(void);
+	void measured(uint64_t nanoseconds);
+
+public:
+	Store(SnapshotQueue &queue, const StoreTargets &targets);
+	virtual ~Store();
+	void finish(void);
+};
+
+#endif /* STORE_H_ */
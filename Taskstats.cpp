@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+extern "C" {
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+}
+
+#include <atomic>
+#include "Taskstats.h"
+
+// Zero until open() found the family
+uint16_t Taskstats::family = 0;
+thread_local int Taskstats::sock = -1;
+
+static std::atomic<uint32_t> next_sequence(1);
+
+static struct nlattr *firstAttribute(struct nlmsghdr *h, int &remaining) {
+	remaining = h->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+	return reinterpret_cast<struct nlattr *>(
+			static_cast<char *>(NLMSG_DATA(h)) + GENL_HDRLEN);
+}
+
+static struct nlattr *nextAttribute(struct nlattr *a, int &remaining) {
+	remaining -= NLA_ALIGN(a->nla_len);
+	return reinterpret_cast<struct nlattr *>(
+			reinterpret_cast<char *>(a) + NLA_ALIGN(a->nla_len));
+}
+
+static bool attributeOk(struct nlattr *a, int remaining) {
+	return remaining >= int(NLA_HDRLEN) && a->nla_len >= NLA_HDRLEN
+			&& int(a->nla_len) <= remaining;
+}
+
+static char *attributeData(struct nlattr *a) {
+	return reinterpret_cast<char *>(a) + NLA_HDRLEN;
+}
+
+bool Taskstats::connect(void) {
+	if (sock != -1)
+		return true;
+
+	sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+	if (sock == -1)
+		return false;
+
+	struct sockaddr_nl address;
+	memset(&address, 0, sizeof(address));
+	address.nl_family = AF_NETLINK;
+	if (bind(sock, reinterpret_cast<struct sockaddr *>(&address),
+			sizeof(address)) == -1) {
+		close(sock);
+		sock = -1;
+		return false;
+	}
+	return true;
+}
+
+// Send one request with a single attribute and wait for its answer, which
+// is left in reply. False on a netlink error, ESRCH for a process that is
+// gone among them.
+bool Taskstats::query(uint16_t type, uint8_t command, uint16_t attribute,
+		const void *value, size_t length, char *reply, size_t size) {
+	if (connect() == false)
+		return false;
+
+	char request[NLMSG_LENGTH(GENL_HDRLEN + NLA_HDRLEN + 32)]
+			__attribute__((aligned(NLMSG_ALIGNTO)));
+	if (NLA_ALIGN(NLA_HDRLEN + length) > 32)
+		return false;
+	memset(request, 0, sizeof(request));
+
+	struct nlmsghdr *h = reinterpret_cast<struct nlmsghdr *>(request);
+	h->nlmsg_type = type;
+	h->nlmsg_flags = NLM_F_REQUEST;
+	h->nlmsg_seq = next_sequence++;
+	struct genlmsghdr *g = static_cast<struct genlmsghdr *>(NLMSG_DATA(h));
+	g->cmd = command;
+	g->version = TASKSTATS_GENL_VERSION;
+	struct nlattr *a = reinterpret_cast<struct nlattr *>(
+			reinterpret_cast<char *>(g) + GENL_HDRLEN);
+	a->nla_type = attribute;
+	a->nla_len = NLA_HDRLEN + length;
+	memcpy(attributeData(a), value, length);
+	h->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + NLA_ALIGN(a->nla_len));
+
+	ssize_t n;
+	while ((n = send(sock, request, h->nlmsg_len, 0)) == -1 && errno == EINTR)
+		;
+	if (n == -1)
+		return false;
+
+	// Skip answers to requests that were given up on
+	while (true) {
+		n = recv(sock, reply, size, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n < int(NLMSG_HDRLEN))
+			return false;
+		struct nlmsghdr *r = reinterpret_cast<struct nlmsghdr *>(reply);
+		if (NLMSG_OK(r, n) == false)
+			return false;
+		if (r->nlmsg_seq != h->nlmsg_seq)
+			continue;
+		return r->nlmsg_type != NLMSG_ERROR;
+	}
+}
+
+bool Taskstats::stats(uint16_t attribute, pid_t pid, struct taskstats &out) {
+	if (family == 0)
+		return false;
+
+	char reply[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+	uint32_t id = pid;
+	if (query(family, TASKSTATS_CMD_GET, attribute, &id, sizeof(id), reply,
+			sizeof(reply)) == false)
+		return false;
+
+	// TASKSTATS_TYPE_AGGR_PID or _TGID nests the id and the stats
+	int remaining;
+	for (struct nlattr *a = firstAttribute(
+			reinterpret_cast<struct nlmsghdr *>(reply), remaining);
+			attributeOk(a, remaining); a = nextAttribute(a, remaining)) {
+		if (a->nla_type != TASKSTATS_TYPE_AGGR_PID
+				&& a->nla_type != TASKSTATS_TYPE_AGGR_TGID)
+			continue;
+		int nested = a->nla_len - NLA_HDRLEN;
+		for (struct nlattr *b = reinterpret_cast<struct nlattr *>(attributeData(
+				a)); attributeOk(b, nested); b = nextAttribute(b, nested)) {
+			if (b->nla_type != TASKSTATS_TYPE_STATS)
+				continue;
+			// Older kernels send a shorter struct, newer ones a longer one
+			size_t length = b->nla_len - NLA_HDRLEN;
+			memset(&out, 0, sizeof(out));
+			memcpy(&out, attributeData(b),
+					length < sizeof(out) ? length : sizeof(out));
+			return true;
+		}
+	}
+	return false;
+}
+
+// Look up the family and check that this process may query it
+bool Taskstats::open(void) {
+	char reply[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+	if (query(GENL_ID_CTRL, CTRL_CMD_GETFAMILY, CTRL_ATTR_FAMILY_NAME,
+			TASKSTATS_GENL_NAME, sizeof(TASKSTATS_GENL_NAME), reply,
+			sizeof(reply)) == false)
+		return false;
+
+	int remaining;
+	for (struct nlattr *a = firstAttribute(
+			reinterpret_cast<struct nlmsghdr *>(reply), remaining);
+			attributeOk(a, remaining); a = nextAttribute(a, remaining)) {
+		if (a->nla_type == CTRL_ATTR_FAMILY_ID) {
+			memcpy(&family, attributeData(a), sizeof(family));
+			break;
+		}
+	}
+
+	struct taskstats self;
+	if (family == 0 || process(getpid(), self) == false) {
+		family = 0;
+		return false;
+	}
+	return true;
+}
+
+bool Taskstats::enabled(void) {
+	return family != 0;
+}
+
+bool Taskstats::process(pid_t tgid, struct taskstats &out) {
+	return stats(TASKSTATS_CMD_ATTR_TGID, tgid, out);
+}
+
+bool Taskstats::thread(pid_t pid, struct taskstats &out) {
+	return stats(TASKSTATS_CMD_ATTR_PID, pid, out);
+}
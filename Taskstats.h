@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef TASKSTATS_H_
+#define TASKSTATS_H_
+
+extern "C" {
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/taskstats.h>
+}
+
+// Queries the kernel's TASKSTATS generic netlink family, which answers with
+// a binary struct taskstats. A query for a thread group (process) sums CPU
+// times, scheduling delays and context switches over all of its threads; a
+// query for a single PID has memory and I/O figures, but only those of
+// that one thread. Each thread that queries gets a socket of its own.
+class Taskstats {
+private:
+	static uint16_t family;
+	static thread_local int sock;
+
+	static bool connect(void);
+	static bool query(uint16_t type, uint8_t command, uint16_t attribute,
+			const void *value, size_t length, char *reply, size_t size);
+	static bool stats(uint16_t attribute, pid_t pid, struct taskstats &out);
+
+public:
+	static bool open(void);
+	static bool enabled(void);
+	static bool process(pid_t tgid, struct taskstats &out);
+	static bool thread(pid_t pid, struct taskstats &out);
+};
+
+#endif /* TASKSTATS_H_ */
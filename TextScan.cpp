@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TEXTSCAN_X86 1
+extern "C" {
+#include <immintrin.h>
+}
+#endif
+
+#include "TextScan.h"
+
+// The vector versions handle whole blocks and leave the bytes after the
+// last one to these, so no kernel reads outside of data. The AVX2 versions
+// pass their remainder on to SSE2 after clearing the upper halves of the
+// registers, which GCC leaves out of a tail call and without which the
+// SSE2 code runs many times slower.
+
+static void nulToSpaceScalar(char *data, size_t length) {
+	for (size_t i = 0; i < length; ++i) {
+		if (data[i] == '\0')
+			data[i] = ' ';
+	}
+}
+
+static const char *findLastScalar(const char *data, size_t length, char c) {
+	while (length > 0) {
+		if (data[--length] == c)
+			return data + length;
+	}
+	return NULL;
+}
+
+// Continue splitting at i; space tells whether data[i - 1] was a space
+static size_t splitFieldsFrom(const char *data, size_t i, size_t length,
+		bool space, const char *fields[], size_t count, size_t max) {
+	for (; i < length && count < max; ++i) {
+		if (data[i] == ' ') {
+			space = true;
+		} else {
+			if (space)
+				fields[count++] = data + i;
+			space = false;
+		}
+	}
+	return count;
+}
+
+static size_t splitFieldsScalar(const char *data, size_t length,
+		const char *fields[], size_t max) {
+	return splitFieldsFrom(data, 0, length, true, fields, 0, max);
+}
+
+#ifdef TEXTSCAN_X86
+
+// A NUL compares equal to zero, and or-ing 0x20 into it makes it a space
+__attribute__((target("sse2")))
+static void nulToSpaceSSE2(char *data, size_t length) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i space = _mm_set1_epi8(' ');
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		__m128i *p = reinterpret_cast<__m128i *>(data + i);
+		__m128i v = _mm_loadu_si128(p);
+		__m128i nul = _mm_cmpeq_epi8(v, zero);
+		if (_mm_movemask_epi8(nul) != 0)
+			_mm_storeu_si128(p, _mm_or_si128(v, _mm_and_si128(nul, space)));
+	}
+	nulToSpaceScalar(data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static void nulToSpaceAVX2(char *data, size_t length) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i space = _mm256_set1_epi8(' ');
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		__m256i *p = reinterpret_cast<__m256i *>(data + i);
+		__m256i v = _mm256_loadu_si256(p);
+		__m256i nul = _mm256_cmpeq_epi8(v, zero);
+		if (_mm256_movemask_epi8(nul) != 0)
+			_mm256_storeu_si256(p,
+					_mm256_or_si256(v, _mm256_and_si256(nul, space)));
+	}
+	_mm256_zeroupper();
+	nulToSpaceSSE2(data + i, length - i);
+}
+
+// Blocks are taken from the end, the remainder at the start is scalar
+__attribute__((target("sse2")))
+static const char *findLastSSE2(const char *data, size_t length, char c) {
+	const __m128i needle = _mm_set1_epi8(c);
+	while (length >= 16) {
+		length -= 16;
+		__m128i v = _mm_loadu_si128(
+				reinterpret_cast<const __m128i *>(data + length));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+		if (mask != 0)
+			return data + length + 31 - __builtin_clz(mask);
+	}
+	return findLastScalar(data, length, c);
+}
+
+__attribute__((target("avx2")))
+static const char *findLastAVX2(const char *data, size_t length, char c) {
+	const __m256i needle = _mm256_set1_epi8(c);
+	while (length >= 32) {
+		length -= 32;
+		__m256i v = _mm256_loadu_si256(
+				reinterpret_cast<const __m256i *>(data + length));
+		unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+		if (mask != 0)
+			return data + length + 31 - __builtin_clz(mask);
+	}
+	_mm256_zeroupper();
+	return findLastSSE2(data, length, c);
+}
+
+// A field starts at a byte that is not a space and follows one. With the
+// spaces of a block as a bit mask that is ~space & (space << 1), carrying
+// the top bit of each block into the next.
+__attribute__((target("sse2")))
+static size_t splitFieldsSSE2(const char *data, size_t length,
+		const char *fields[], size_t max) {
+	const __m128i needle = _mm_set1_epi8(' ');
+	size_t count = 0, i = 0;
+	unsigned carry = 1;
+	for (; i + 16 <= length && count < max; i += 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+		unsigned space = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+		unsigned starts = ~space & ((space << 1) | carry) & 0xffff;
+		carry = space >> 15;
+		for (; starts != 0 && count < max; starts &= starts - 1)
+			fields[count++] = data + i + __builtin_ctz(starts);
+	}
+	return splitFieldsFrom(data, i, length, carry != 0, fields, count, max);
+}
+
+__attribute__((target("avx2")))
+static size_t splitFieldsAVX2(const char *data, size_t length,
+		const char *fields[], size_t max) {
+	const __m256i needle = _mm256_set1_epi8(' ');
+	size_t count = 0, i = 0;
+	unsigned carry = 1;
+	for (; i + 32 <= length && count < max; i += 32) {
+		__m256i v = _mm256_loadu_si256(
+				reinterpret_cast<const __m256i *>(data + i));
+		unsigned space = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+		unsigned starts = ~space & ((space << 1) | carry);
+		carry = space >> 31;
+		for (; starts != 0 && count < max; starts &= starts - 1)
+			fields[count++] = data + i + __builtin_ctz(starts);
+	}
+	_mm256_zeroupper();
+	return splitFieldsFrom(data, i, length, carry != 0, fields, count, max);
+}
+
+const TextScan::Kernels TextScan::kernels[LEVELS] = {
+		{ nulToSpaceScalar, findLastScalar, splitFieldsScalar },
+		{ nulToSpaceSSE2, findLastSSE2, splitFieldsSSE2 },
+		{ nulToSpaceAVX2, findLastAVX2, splitFieldsAVX2 } };
+
+#else
+
+const TextScan::Kernels TextScan::kernels[LEVELS] = {
+		{ nulToSpaceScalar, findLastScalar, splitFieldsScalar },
+		{ nulToSpaceScalar, findLastScalar, splitFieldsScalar },
+		{ nulToSpaceScalar, findLastScalar, splitFieldsScalar } };
+
+#endif
+
+TextScan::Level TextScan::level = TextScan::best();
+
+bool TextScan::supported(Level l) {
+#ifdef TEXTSCAN_X86
+	__builtin_cpu_init();
+	switch (l) {
+	case SCALAR:
+		return true;
+	case SSE2:
+		return __builtin_cpu_supports("sse2");
+	case AVX2:
+		return __builtin_cpu_supports("avx2");
+	default:
+		return false;
+	}
+#else
+	return l == SCALAR;
+#endif
+}
+
+TextScan::Level TextScan::best(void) {
+	if (supported(AVX2))
+		return AVX2;
+	if (supported(SSE2))
+		return SSE2;
+	return SCALAR;
+}
+
+TextScan::Level TextScan::getLevel(void) {
+	return level;
+}
+
+// Used by the benchmarks to compare the versions. Levels the CPU does not
+// support are ignored.
+void TextScan::setLevel(Level l) {
+	if (l < LEVELS && supported(l))
+		level = l;
+}
+
+const char *TextScan::name(Level l) {
+	static const char *names[LEVELS] = { "scalar", "sse2", "avx2" };
+	return l < LEVELS ? names[l] : "unknown";
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2014,2019 Jared H. Hudson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef TEXTSCAN_H_
+#define TEXTSCAN_H_
+
+extern "C" {
+#include <stddef.h>
+}
+
+// Byte scanning for the text of /proc files. Each kernel has a scalar
+// version and, on x86, SSE2 and AVX2 versions; the widest one the CPU
+// supports is picked when the program starts. Every version gives the
+// same result for the same input, which Bench::kernels() checks.
+class TextScan {
+public:
+	enum Level {
+		SCALAR, SSE2, AVX2, LEVELS
+	};
+
+private:
+	struct Kernels {
+		void (*nulToSpace)(char *data, size_t length);
+		const char *(*findLast)(const char *data, size_t length, char c);
+		size_t (*splitFields)(const char *data, size_t length,
+				const char *fields[], size_t max);
+	};
+
+	static const Kernels kernels[LEVELS];
+	static Level level;
+	static Level best(void);
+
+public:
+	static bool supported(Level l);
+	static Level getLevel(void);
+	static void setLevel(Level l);
+	static const char *name(Level l);
+
+	// Replace every NUL in data with a space, for the arguments of cmdline
+	static void nulToSpace(char *data, size_t length) {
+		kernels[level].nulToSpace(data, length);
+	}
+
+	// The last c in data, or NULL
+	static const char *findLast(const char *data, size_t length, char c) {
+		return kernels[level].findLast(data, length, c);
+	}
+
+	// Store the start of up to max space separated fields of data and
+	// return how many were found. data is taken to follow a space, so a
+	// field at its very start counts.
+	static size_t splitFields(const char *data, size_t length,
+			const char *fields[], size_t max) {
+		return kernels[level].splitFields(data, length, fields, max);
+	}
+};
+
+#endif /* TEXTSCAN_H_ */
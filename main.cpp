@@ -20,7 +20,8 @@
 extern "C" {
 #include <stdlib.h>
 #include <stdio.h>
-#include <dirent.h>
+#include <unistd.h>
+#include <signal.h>
 #include <sys/utsname.h>
 }
 
@@ -38,28 +39,279 @@ namespace po = boost::program_options;
 #include "Pid.h"
 #include "Pgsql.h"
 #include "Clock.h"
+#include "Sampler.h"
+#include "ProcReader.h"
+#include "ProcUring.h"
+#include "Bench.h"
+#include "Scanner.h"
+#include "Delta.h"
+#include "Rates.h"
+#include "Filter.h"
+#include "SnapshotQueue.h"
+#include "Store.h"
+#include "PidSchema.h"
+#include "Snapshot.h"
+#include "SetWriter.h"
+#include "Recording.h"
+#include "Metrics.h"
+#include "Cmdlines.h"
+#include "Spool.h"
+#include "Replay.h"
+#include "Relay.h"
+#include "ProcEvents.h"
+#include "Taskstats.h"
 
 // To setup PostgreSQL database do the following in pgsql as postgres user.
 // CREATE ROLE piduser WITH LOGIN PASSWORD 'yter4Fk3';
 // CREATE DATABASE piddb;
 // \c piddb
-// create table pid_sets ( set_id serial primary key, pgserver_time timestamp with time zone DEFAULT CURRENT_TIMESTAMP, node_time timestamp with time zone, nodename text);
-// CREATE TABLE pids ( set_id integer references pid_sets, pid INTEGER, comm TEXT, cmdline TEXT, state TEXT, ppid INTEGER, pgrp INTEGER, session INTEGER, tty_nr INTEGER, tpgid INTEGER, flags INTEGER, minflt INTEGER, cminflt INTEGER, majflt INTEGER, cmajflt INTEGER, utime INTEGER, stime INTEGER, cutime INTEGER, priority INTEGER, nice INTEGER, num_threads INTEGER);
-// GRANT INSERT ON pids,pid_sets TO piduser;
+// create table pid_sets ( set_id serial primary key, pgserver_time timestamp with time zone DEFAULT CURRENT_TIMESTAMP, node_time timestamp with time zone, upload_time timestamp with time zone, nodename text, kind char(1) DEFAULT 'K');
+// CREATE UNIQUE INDEX pid_sets_node_time ON pid_sets (nodename, node_time);
+// CREATE TABLE cmdlines ( id bigserial primary key, hash BIGINT NOT NULL, text TEXT NOT NULL);
+// CREATE UNIQUE INDEX cmdlines_hash_text ON cmdlines (hash, md5(text));
+// CREATE TABLE pids ( set_id integer references pid_sets, pid INTEGER, comm TEXT, cmdline TEXT, cmdline_id BIGINT references cmdlines, state TEXT, ppid INTEGER, pgrp INTEGER, session INTEGER, tty_nr INTEGER, tpgid INTEGER, flags INTEGER, minflt INTEGER, cminflt INTEGER, majflt INTEGER, cmajflt INTEGER, utime INTEGER, stime INTEGER, cutime INTEGER, priority INTEGER, nice INTEGER, num_threads INTEGER, starttime BIGINT, rss BIGINT, cpu_delay BIGINT, blkio_delay BIGINT, swapin_delay BIGINT, nvcsw BIGINT, nivcsw BIGINT, hiwater_rss BIGINT, read_bytes BIGINT, write_bytes BIGINT, read_time BIGINT, start_time BIGINT, utime_rate BIGINT, stime_rate BIGINT, minflt_rate BIGINT, majflt_rate BIGINT);
+// CREATE TABLE pid_deltas ( LIKE pids, change char(1));
+// ALTER TABLE pid_deltas ADD FOREIGN KEY (set_id) REFERENCES pid_sets;
+// CREATE TABLE collector_stats ( nodename text, stat_time timestamp with time zone, enumerate_count BIGINT, enumerate_p50 BIGINT, enumerate_p99 BIGINT, enumerate_max BIGINT, parse_count BIGINT, parse_p50 BIGINT, parse_p99 BIGINT, parse_max BIGINT, prepare_count BIGINT, prepare_p50 BIGINT, prepare_p99 BIGINT, prepare_max BIGINT, send_count BIGINT, send_p50 BIGINT, send_p99 BIGINT, send_max BIGINT, commit_count BIGINT, commit_p50 BIGINT, commit_p99 BIGINT, commit_max BIGINT, cycle_count BIGINT, cycle_p50 BIGINT, cycle_p99 BIGINT, cycle_max BIGINT, pids_vanished BIGINT, flush_waits BIGINT, db_errors BIGINT, queue_dropped BIGINT, queue_coalesced BIGINT, pids_filtered BIGINT, queue_depth BIGINT, upload_window_ms BIGINT);
+// GRANT INSERT ON pids,pid_sets,pid_deltas,collector_stats TO piduser;
+// GRANT SELECT, INSERT ON cmdlines TO piduser;
+// grant ALL on cmdlines_id_seq TO piduser;
 // grant ALL on pid_sets_set_id_seq TO piduser;
 //
+// The eight pids columns from cpu_delay to write_bytes are filled with
+// --taskstats and are zero otherwise. Delay accounting needs the
+// kernel.task_delayacct sysctl (or the delayacct boot option) on kernels
+// since 5.14.
+//
+// read_time and start_time are filled with --read-times: when the
+// process's stat was read and when it started, in nanoseconds since boot.
+// A long scan reads its processes over many milliseconds, so CPU rates
+// are exact when worked out between read_times rather than node_times,
+// and read_time - start_time is the process's age. A delta set does not
+// count a new read_time as a change.
+//
+// When running with --interval, the collector works out utime, stime,
+// minflt and majflt per second since the process's previous sample, in
+// thousandths: a utime_rate of 1000 is a CPU's worth of user time and a
+// majflt_rate of 1000 one major fault a second. The interval is the time
+// between the process's two reads with --read-times and between the two
+// snapshots otherwise. They are -1 in the first snapshot, for processes
+// that were not in the one before, and in one-shot runs. Snapshots dropped
+// from the queue still count, rates are from one scan to the next.
+//
+// --exclude-kthreads, --top and --keep limit the processes stored with
+// each set. With --other, those left out are summed into a row with PID 0
+// and comm and cmdline "other", state '-': counters, rates, threads and
+// RSS are totals and the other columns zero. pids_filtered in
+// collector_stats counts the processes left out. --top and --keep pick a
+// different set of processes from one snapshot to the next, so they
+// cannot be used with --delta. --exclude-kthreads can: a process leaves
+// a set only when it exits or becomes a zombie, whose cmdline is empty,
+// and a delta's X row stands for either.
+//
+// pid_sets.kind is K for a keyframe, whose processes are all in pids, or D
+// for a delta set (--delta). A delta set only has rows in pid_deltas, one
+// per process that is new (change N), changed (C) or exited (X) since the
+// previous set of the node. Exited rows carry the last values seen. A
+// node's state at any set is its latest keyframe with the later deltas
+// applied in set_id order. Collectors reserve set_ids from the pid_sets
+// sequence a block at a time, so the pid_sets row and the processes of a
+// set are sent together; ids of a node still ascend in the order its sets
+// were taken, but gaps are left where reserved ids went unused.
+//
+// node_time is when the processes were read and upload_time when the set
+// was sent, by the node or by the relay that stored it. They differ by the
+// node's --spread share and whatever time the set spent queued, spooled
+// or relayed. With --align, node_time falls on the same moments on every
+// node, and --spread keeps those nodes from all storing at that moment.
+//
+// With --spool, snapshots that cannot be stored are kept in a local file
+// and stored later as keyframes, oldest first. New snapshots queue behind
+// them, so set_id order stays the order they were taken in. Replaying
+// needs PostgreSQL 9.5 or later and the unique index above, which lets a
+// snapshot that was stored but not acknowledged be skipped. Spooled
+// snapshots hold every pids column, so a version that adds columns, or
+// changes the snapshot format, cannot read those of the version before
+// and refuses to start while the spool holds any. Let the old version
+// store what is spooled before upgrading, or remove the spool file to give
+// up those snapshots.
+//
+// A fleet of collectors can send to a relay (--relay-addr) instead of the
+// database. The relay (--relay) stores what arrives from all of them in a
+// few large transactions on --relay-connections connections. Sets that go
+// through a relay are always keyframes. To try it on one machine, start
+//   pid2pgsql --relay /tmp/relay.sock -d piddb
+// and any number of
+//   pid2pgsql --relay-addr /tmp/relay.sock --nodename nodeN -i 1000
+//
+// With --cmdlines, each distinct command line is stored once in cmdlines
+// and pids rows only carry its cmdline_id, leaving cmdline NULL. The ids
+// are cached in the file given, so a restarted collector only sends the
+// command lines it has not seen before. Read the text back with
+//   SELECT p.*, coalesce(c.text, p.cmdline) AS cmdline_text
+//   FROM pids p LEFT JOIN cmdlines c ON c.id = p.cmdline_id;
+//
+// The collector times its phases and counts processes that vanished
+// before they were read, waits for the socket to drain and database
+// errors. --metrics-file and --metrics-addr give them out in Prometheus
+// text format, --collector-stats stores a collector_stats row every few
+// sets with each phase's count, median, 99th percentile and maximum in
+// nanoseconds over the sets since the previous row.
+//
+// To load-test a server, take snapshots into a file with
+//   pid2pgsql --record /tmp/node.rec -i 1000
+// and store them again as keyframes of many nodes, ten times as fast:
+//   pid2pgsql --replay /tmp/node.rec --nodes 200 --speed 10 -d scratchdb
+//
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void requestStop(int) {
+	stop_requested = 1;
+}
 
 int main(int argc, char *argv[]) {
 	bool debug = false;
 	string dbname, dbhost, dbusername, dbpassword;
+	SetWriter::Method method = SetWriter::COPY;
+	unsigned interval = 0;
+	bool daemonize = false;
+	unsigned bench_rounds = 0;
+	unsigned threads = 1;
+	unsigned keyframe_interval = 0;
+	bool pipeline = true;
+	bool io_uring = false;
+	string spool_path;
+	size_t spool_size = 256;
+	string relay_listen, relay_addr, nodename;
+	unsigned relay_connections = 2;
+	unsigned reconcile_interval = 0;
+	bool taskstats = false;
+	bool read_times = false;
+	Filter filter;
+	string proc_root = "/proc", make_proc;
+	unsigned processes = 1000;
+	size_t cmdline_size = 200;
+	string record_path, replay_path;
+	double speed = 1;
+	unsigned nodes = 1;
+	string metrics_file, metrics_addr;
+	unsigned stats_interval = 0;
+	string cmdlines_path;
+	size_t queue_size = 8;
+	SnapshotQueue::Policy overflow = SnapshotQueue::DROP_OLDEST;
+	bool align = false;
+	unsigned spread = 0;
+	bool spread_backoff = false;
 	try {
 		po::options_description desc("Allowed options");
 		desc.add_options()("help,?", "produce_help_message");
 		desc.add_options()("debug,D", "enable debug messages");
-		desc.add_options()("dbname,d", "database name");
-		desc.add_options()("host,h", "database server host");
-		desc.add_options()("username,U", "database user name");
-		desc.add_options()("password,W", "database password");
+		desc.add_options()("dbname,d", po::value<string>(), "database name");
+		desc.add_options()("host,h", po::value<string>(), "database server host");
+		desc.add_options()("username,U", po::value<string>(), "database user name");
+		desc.add_options()("password,W", po::value<string>(), "database password");
+		desc.add_options()("writer,w", po::value<string>(),
+				"how pids rows are sent: copy (default), copy-text or insert");
+		desc.add_options()("no-pipeline",
+				"wait for each statement instead of using libpq pipeline mode");
+		desc.add_options()("queue", po::value<size_t>(),
+				"snapshots that may wait for the database before the "
+				"--overflow policy applies (8)");
+		desc.add_options()("overflow", po::value<string>(),
+				"what a full queue does: drop-oldest (default), coalesce "
+				"(with --delta, fold the dropped snapshots into the next "
+				"delta) or block (delay the next snapshot)");
+		desc.add_options()("interval,i", po::value<unsigned>(),
+				"keep running and take a snapshot every arg milliseconds");
+		desc.add_options()("align",
+				"take the snapshots on multiples of --interval in wall clock "
+				"time, the same moments on every node");
+		desc.add_options()("spread", po::value<unsigned>(),
+				"wait up to arg milliseconds after each snapshot before "
+				"storing it, a share of the window set by the node name");
+		desc.add_options()("spread-backoff",
+				"widen the --spread window, up to --interval, while storing "
+				"sets takes longer than it used to");
+		desc.add_options()("daemon", "detach and run in the background, "
+				"every 60000 ms unless --interval is given");
+		desc.add_options()("delta", po::value<unsigned>()->implicit_value(60),
+				"store only new, changed and exited processes, with a full "
+				"keyframe set every arg sets");
+		desc.add_options()("events", po::value<unsigned>()->implicit_value(60),
+				"follow process starts and exits through the kernel's proc "
+				"connector, with a full /proc scan every arg sets");
+		desc.add_options()("taskstats",
+				"read scheduling delays, context switches, peak RSS and I/O "
+				"from the kernel's taskstats interface");
+		desc.add_options()("read-times",
+				"record when each process was read and when it started, in "
+				"nanoseconds since boot");
+		desc.add_options()("exclude-kthreads",
+				"leave kernel threads out of the snapshots");
+		desc.add_options()("top", po::value<size_t>(),
+				"keep only the arg processes using the most --top-by, besides "
+				"those matching --keep");
+		desc.add_options()("top-by", po::value<string>(),
+				"what --top ranks processes by: cpu (default), rss or faults");
+		desc.add_options()("keep", po::value<vector<string> >(),
+				"always keep processes whose cmdline or comm matches this "
+				"extended regular expression, can be given more than once; "
+				"without --top, keep only those");
+		desc.add_options()("other",
+				"sum the processes that are left out into one row named "
+				"other");
+		desc.add_options()("io-uring",
+				"batch the opens, reads and closes of /proc files through "
+				"io_uring where the kernel allows it");
+		desc.add_options()("threads,t", po::value<unsigned>(),
+				"processes are read by arg threads, 0 for one per CPU (default 1)");
+		desc.add_options()("spool", po::value<string>(),
+				"keep snapshots that cannot be stored in file arg and store "
+				"them once the database is back");
+		desc.add_options()("spool-size", po::value<size_t>(),
+				"size of the spool file in MB (default 256), the oldest "
+				"snapshots are dropped when it is full");
+		desc.add_options()("relay", po::value<string>(),
+				"run as a relay: accept snapshots from collectors on address "
+				"arg (a socket path or host:port) and store them");
+		desc.add_options()("relay-connections", po::value<unsigned>(),
+				"database connections the relay stores on (default 2)");
+		desc.add_options()("relay-addr", po::value<string>(),
+				"send snapshots to the relay at address arg instead of the "
+				"database");
+		desc.add_options()("nodename", po::value<string>(),
+				"store snapshots under node name arg instead of the host name");
+		desc.add_options()("record", po::value<string>(),
+				"write snapshots to the file arg instead of the database");
+		desc.add_options()("replay", po::value<string>(),
+				"store the snapshots recorded in file arg and exit");
+		desc.add_options()("speed", po::value<double>(),
+				"replay at arg times the recorded pace, 0 for no waits (1)");
+		desc.add_options()("nodes", po::value<unsigned>(),
+				"replay every snapshot as arg distinct nodes (1)");
+		desc.add_options()("cmdlines", po::value<string>(),
+				"store cmdline_id instead of cmdline, caching the ids in "
+				"file arg");
+		desc.add_options()("metrics-file", po::value<string>(),
+				"write collector metrics to the file arg after every set, in "
+				"Prometheus text format");
+		desc.add_options()("metrics-addr", po::value<string>(),
+				"serve collector metrics over HTTP at address arg");
+		desc.add_options()("collector-stats",
+				po::value<unsigned>()->implicit_value(60),
+				"store collector metrics in collector_stats every arg sets");
+		desc.add_options()("bench", po::value<unsigned>()->implicit_value(10),
+				"time parsing and writing of every process arg times and "
+				"exit; with -d also time storing sets in that database");
+		desc.add_options()("proc-root", po::value<string>(),
+				"read processes from arg instead of /proc");
+		desc.add_options()("make-proc", po::value<string>(),
+				"write a synthetic proc tree to arg and exit");
+		desc.add_options()("processes", po::value<unsigned>(),
+				"number of processes for --make-proc (1000)");
+		desc.add_options()("cmdline-size", po::value<size_t>(),
+				"cmdline length in bytes for --make-proc (200)");
 		po::variables_map vm;
 		po::store(po::parse_command_line(argc, argv, desc), vm);
 		po::notify(vm);
@@ -75,13 +327,189 @@ int main(int argc, char *argv[]) {
 			dbname = vm["dbname"].as<string>();
 		}
 		if (vm.count("host")) {
-			dbname = vm["host"].as<string>();
+			dbhost = vm["host"].as<string>();
 		}
 		if (vm.count("username")) {
-			dbname = vm["username"].as<string>();
+			dbusername = vm["username"].as<string>();
 		}
 		if (vm.count("password")) {
-			dbname = vm["password"].as<string>();
+			dbpassword = vm["password"].as<string>();
+		}
+		if (vm.count("writer")) {
+			string writer = vm["writer"].as<string>();
+			if (writer == "copy") {
+				method = SetWriter::COPY;
+			} else if (writer == "copy-text") {
+				method = SetWriter::COPY_TEXT;
+			} else if (writer == "insert") {
+				method = SetWriter::INSERT;
+			} else {
+				cerr << "Unknown writer: " << writer << endl;
+				return EXIT_FAILURE;
+			}
+		}
+		if (vm.count("no-pipeline")) {
+			pipeline = false;
+		}
+		if (vm.count("queue")) {
+			queue_size = vm["queue"].as<size_t>();
+		}
+		if (vm.count("overflow")) {
+			string policy = vm["overflow"].as<string>();
+			if (policy == "drop-oldest") {
+				overflow = SnapshotQueue::DROP_OLDEST;
+			} else if (policy == "coalesce") {
+				overflow = SnapshotQueue::COALESCE;
+			} else if (policy == "block") {
+				overflow = SnapshotQueue::BLOCK;
+			} else {
+				cerr << "Unknown overflow policy: " << policy << endl;
+				return EXIT_FAILURE;
+			}
+		}
+		if (vm.count("io-uring")) {
+			io_uring = true;
+		}
+		if (vm.count("interval")) {
+			interval = vm["interval"].as<unsigned>();
+		}
+		if (vm.count("align")) {
+			align = true;
+		}
+		if (vm.count("spread")) {
+			spread = vm["spread"].as<unsigned>();
+		}
+		if (vm.count("spread-backoff")) {
+			spread_backoff = true;
+		}
+		if (vm.count("delta")) {
+			keyframe_interval = vm["delta"].as<unsigned>();
+		}
+		if (vm.count("events")) {
+			reconcile_interval = vm["events"].as<unsigned>();
+		}
+		if (vm.count("taskstats")) {
+			taskstats = true;
+		}
+		if (vm.count("read-times")) {
+			read_times = true;
+		}
+		if (vm.count("exclude-kthreads")) {
+			filter.excludeKthreads();
+		}
+		if (vm.count("top")) {
+			Filter::Key key = Filter::CPU;
+			string by = vm.count("top-by") ? vm["top-by"].as<string>() : "cpu";
+			if (by == "rss") {
+				key = Filter::RSS;
+			} else if (by == "faults") {
+				key = Filter::FAULTS;
+			} else if (by != "cpu") {
+				cerr << "Unknown --top-by: " << by << endl;
+				return EXIT_FAILURE;
+			}
+			filter.keepTop(vm["top"].as<size_t>(), key);
+		}
+		if (vm.count("keep")
+				&& filter.keepMatching(vm["keep"].as<vector<string> >()) == false) {
+			return EXIT_FAILURE;
+		}
+		if (vm.count("other")) {
+			filter.rollUp();
+		}
+		// A process leaving the top N or changing its cmdline would show
+		// up in pid_deltas as an exit
+		if (keyframe_interval > 0 && (vm.count("top") || vm.count("keep"))) {
+			cerr << "--top and --keep cannot be used with --delta" << endl;
+			return EXIT_FAILURE;
+		}
+		if (vm.count("threads")) {
+			threads = vm["threads"].as<unsigned>();
+		}
+		if (vm.count("spool")) {
+			spool_path = vm["spool"].as<string>();
+		}
+		if (vm.count("spool-size")) {
+			spool_size = vm["spool-size"].as<size_t>();
+		}
+		if (vm.count("relay")) {
+			relay_listen = vm["relay"].as<string>();
+		}
+		if (vm.count("relay-connections")) {
+			relay_connections = vm["relay-connections"].as<unsigned>();
+		}
+		if (vm.count("relay-addr")) {
+			relay_addr = vm["relay-addr"].as<string>();
+			if (keyframe_interval > 0) {
+				cerr << "--delta cannot be used with --relay-addr" << endl;
+				return EXIT_FAILURE;
+			}
+		}
+		if (vm.count("nodename")) {
+			nodename = vm["nodename"].as<string>();
+		}
+		if (vm.count("record")) {
+			record_path = vm["record"].as<string>();
+			if (keyframe_interval > 0 || spool_path.empty() == false
+					|| relay_addr.empty() == false) {
+				cerr << "--record cannot be used with --delta, --spool or "
+						"--relay-addr" << endl;
+				return EXIT_FAILURE;
+			}
+		}
+		if (vm.count("replay")) {
+			replay_path = vm["replay"].as<string>();
+		}
+		if (vm.count("speed")) {
+			speed = vm["speed"].as<double>();
+			if (speed < 0) {
+				cerr << "--speed must not be negative" << endl;
+				return EXIT_FAILURE;
+			}
+		}
+		if (vm.count("nodes")) {
+			nodes = vm["nodes"].as<unsigned>();
+			if (nodes == 0) {
+				cerr << "--nodes must be at least 1" << endl;
+				return EXIT_FAILURE;
+			}
+		}
+		if (vm.count("cmdlines")) {
+			cmdlines_path = vm["cmdlines"].as<string>();
+		}
+		if (vm.count("metrics-file")) {
+			metrics_file = vm["metrics-file"].as<string>();
+		}
+		if (vm.count("metrics-addr")) {
+			metrics_addr = vm["metrics-addr"].as<string>();
+		}
+		if (vm.count("collector-stats")) {
+			stats_interval = vm["collector-stats"].as<unsigned>();
+		}
+		if (vm.count("bench")) {
+			bench_rounds = vm["bench"].as<unsigned>();
+		}
+		if (vm.count("proc-root")) {
+			proc_root = vm["proc-root"].as<string>();
+		}
+		if (vm.count("make-proc")) {
+			make_proc = vm["make-proc"].as<string>();
+		}
+		if (vm.count("processes")) {
+			processes = vm["processes"].as<unsigned>();
+		}
+		if (vm.count("cmdline-size")) {
+			cmdline_size = vm["cmdline-size"].as<size_t>();
+		}
+		if (vm.count("daemon")) {
+			daemonize = true;
+			if (interval == 0) {
+				interval = 60000;
+			}
+		}
+		if (interval > 0 && spread > interval) {
+			cerr << "--spread must not be longer than --interval" << endl;
+			return EXIT_FAILURE;
 		}
 	} catch(...) {
 		return EXIT_FAILURE;
@@ -92,84 +520,228 @@ int main(int argc, char *argv[]) {
 		perror("uname");
 		return EXIT_FAILURE;
 	}
+	if (nodename.empty()) {
+		nodename = utsbuffer.nodename;
+	}
+
+	if (make_proc.empty() == false) {
+		return Bench::makeProc(make_proc, processes, cmdline_size);
+	}
+
+	if (ProcReader::open(proc_root.c_str()) == false) {
+		return EXIT_FAILURE;
+	}
+	if (io_uring) {
+		ProcUring::enable();
+		if (ProcUring::available() == false) {
+			cerr << "io_uring is not available, reading /proc one file at a "
+					"time." << endl;
+		}
+	}
+	if (cmdlines_path.empty() == false) {
+		Cmdlines::open(cmdlines_path);
+	}
 
-	DIR *dir;
-	if ((dir = opendir("/proc")) == NULL) {
-		perror("opendir");
+	// taskstats answers for the live processes, not those of another root
+	if (taskstats && proc_root != "/proc") {
+		cerr << "--taskstats needs /proc as the proc root." << endl;
 		return EXIT_FAILURE;
 	}
+	if (taskstats && Taskstats::open() == false) {
+		cerr << "taskstats is not available, reading /proc only." << endl;
+	}
+	if (read_times) {
+		Pid::recordTimes();
+	}
 
-	int readdir_error = 0;
-	dirent entry;
-	dirent *result = NULL;
-	vector<Pid> pids;
-	while ((readdir_error = readdir_r(dir, &entry, &result)) == 0) {
-		if (result == NULL) {
-			break;
+	if (bench_rounds > 0) {
+		if (Bench::kernels(bench_rounds) != EXIT_SUCCESS
+				|| Bench::parse(bench_rounds, threads) != EXIT_SUCCESS
+				|| Bench::prepare(bench_rounds, threads) != EXIT_SUCCESS) {
+			return EXIT_FAILURE;
+		}
+		if (dbname.empty()) {
+			return EXIT_SUCCESS;
+		}
+		try {
+			Pgsql benchdb(dbhost.c_str(), dbname.c_str(), dbusername.c_str(), dbpassword.c_str(), debug);
+			if (pipeline == false) {
+				benchdb.disablePipeline();
+			}
+			return Bench::store(benchdb, bench_rounds, threads, nodename);
+		} catch(Pgsql::Error *e) {
+			delete e;
+			cerr << "Unable to reach the database." << endl;
+			return EXIT_FAILURE;
 		}
-		if (entry.d_name[0] >= '0' && entry.d_name[0] <= '9') {
-			Pid p(entry.d_name);
-			pids.push_back(p);
+	}
+
+	if (daemonize) {
+		// Stay in the working directory, sslrootcert is a relative path
+		if (daemon(1, debug ? 1 : 0) == -1) {
+			perror("daemon");
+			return EXIT_FAILURE;
 		}
 	}
 
-	closedir(dir);
+	signal(SIGINT, requestStop);
+	signal(SIGTERM, requestStop);
+
+	MetricsServer metrics_server;
+	if (metrics_addr.empty() == false
+			&& metrics_server.listen(metrics_addr) == false) {
+		return EXIT_FAILURE;
+	}
 
-	for (int attempt=0; attempt < 1; ++attempt) {
+	if (relay_listen.empty() == false) {
+		Relay relay(dbhost, dbname, dbusername, dbpassword, debug);
+		if (relay.listen(relay_listen) == false) {
+			return EXIT_FAILURE;
+		}
+		return relay.run(relay_connections, stop_requested);
+	}
+
+	if (replay_path.empty() == false) {
 		try {
-			Pgsql piddb(dbhost.c_str(), dbname.c_str(), dbusername.c_str(), dbpassword.c_str(), debug);
-			piddb.begin();
-			Prepare pid_sets_insert = piddb.createPrepare("pid_sets_insert");
-			pid_sets_insert.setTableName("pid_sets");
-			pid_sets_insert.addCol("nodename", utsbuffer.nodename);
-			string node_time = Clock().str;
-			pid_sets_insert.addCol("node_time", node_time);
-			pid_sets_insert.exec();
-			pid_sets_insert.getResult();
-			uint64_t set_id = piddb.lastval();
-
-			for (vector<Pid>::iterator i = pids.begin(); i != pids.end(); ++i) {
-				Prepare pid_insert = piddb.createPrepare("pid_insert");
-				pid_insert.setTableName("pids");
-				pid_insert.addCol("set_id", set_id);
-				pid_insert.addCol("cmdline", (*i).cmdline);
-				pid_insert.addCol("pid", (*i).mypid);
-				pid_insert.addCol("comm", (*i).comm); // from /proc/#/comm
-				pid_insert.addCol("state", (*i).state);
-				pid_insert.addCol("ppid", (*i).ppid);
-				pid_insert.addCol("pgrp", (*i).pgrp);
-				pid_insert.addCol("session", (*i).session);
-				pid_insert.addCol("tty_nr", (*i).tty_nr);
-				pid_insert.addCol("tpgid", (*i).tpgid);
-				pid_insert.addCol("flags", (*i).flags);
-				pid_insert.addCol("minflt", (*i).minflt);
-				pid_insert.addCol("cminflt", (*i).cminflt);
-				pid_insert.addCol("majflt", (*i).majflt);
-				pid_insert.addCol("cmajflt", (*i).cmajflt);
-				pid_insert.addCol("utime", (*i).utime);
-				pid_insert.addCol("stime", (*i).stime);
-				pid_insert.addCol("cutime", (*i).cutime);
-				pid_insert.addCol("priority", (*i).priority);
-				pid_insert.addCol("nice", (*i).nice);
-				pid_insert.addCol("num_threads", (*i).num_threads);
-				pid_insert.exec();
+			Pgsql replaydb(dbhost.c_str(), dbname.c_str(), dbusername.c_str(), dbpassword.c_str(), debug);
+			if (pipeline == false) {
+				replaydb.disablePipeline();
 			}
-			piddb.commit();
+			return Recording::play(replay_path, speed, nodes, replaydb, method,
+					stop_requested);
+		} catch(Pgsql::Error *e) {
+			delete e;
+			cerr << "Unable to reach the database." << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	// The replay thread is started after daemon(), threads do not survive
+	// its fork
+	Spool *spool = NULL;
+	Replay *replay = NULL;
+	if (spool_path.empty() == false) {
+		spool = new Spool();
+		if (spool->open(spool_path, spool_size << 20) == false) {
+			return EXIT_FAILURE;
+		}
+		// The replay would skip, and so lose, snapshots in another format.
+		// They can only be the oldest: nothing is added to such a spool.
+		vector<string> oldest;
+		Snapshot snapshot;
+		spool->front(oldest, 1);
+		if (oldest.empty() == false
+				&& snapshot.decode(oldest[0].data(), oldest[0].size()) == false) {
+			cerr << spool_path << " holds " << spool->size()
+					<< " snapshots written by another version of pid2pgsql. "
+					"Store them with that version, or remove the file to "
+					"drop them." << endl;
+			return EXIT_FAILURE;
+		}
+		replay = new Replay(*spool, dbhost, dbname, dbusername, dbpassword,
+				relay_addr, debug);
+	}
+	RelayClient *uplink = relay_addr.empty() ? NULL : new RelayClient(relay_addr);
+	Recording *recording = NULL;
+	if (record_path.empty() == false) {
+		recording = new Recording();
+		if (recording->create(record_path) == false) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	Sampler sampler(interval, align);
+	Scanner scanner(threads);
+	ProcEvents *events = NULL;
+	if (reconcile_interval > 0) {
+		events = new ProcEvents(scanner, reconcile_interval);
+		if (events->open() == false) {
+			cerr << "Process events are not available, scanning /proc." << endl;
+			delete events;
+			events = NULL;
+		}
+	}
+	// Snapshots are stored from a thread of their own, so the sampling
+	// cadence does not depend on the database
+	SnapshotQueue queue(queue_size, overflow);
+	StoreTargets targets;
+	targets.dbhost = dbhost;
+	targets.dbname = dbname;
+	targets.dbuser = dbusername;
+	targets.dbpass = dbpassword;
+	targets.nodename = nodename;
+	targets.debug = debug;
+	targets.pipeline = pipeline;
+	targets.method = method;
+	targets.keyframe_interval = keyframe_interval;
+	targets.stats_interval = stats_interval;
+	targets.spread = spread;
+	targets.spread_max = spread_backoff && interval > 0 ? interval : spread;
+	targets.spool = spool;
+	targets.replay = replay;
+	targets.uplink = uplink;
+	targets.recording = recording;
+	Store *store = new Store(queue, targets);
+	Rates *rates = interval > 0 ? new Rates() : NULL;
 
-			// Empty results now that we don't need them
-			for (map<string, PGresult *>::iterator i=Prepare::existing_prepares.begin();
-					i != Prepare::existing_prepares.end(); ++i) {
-				PQclear((*i).second);
+	for (uint64_t attempt = 0; interval > 0 || attempt < 1; ++attempt) {
+		if (interval > 0 && (sampler.wait() == false || stop_requested)) {
+			if (stop_requested) {
+				break;
 			}
-			Prepare::existing_prepares.clear();
-		} catch(...) {
-			cerr << "Unknown Exception caught." << endl;
-			abort();
+			continue;
 		}
+
+		uint64_t cycle_start = Metrics::now();
+		SnapshotQueue::Slot &slot = queue.next();
+		slot.node_time = Clock();
+		if (events != NULL) {
+			events->scan(slot.pids);
+		} else {
+			scanner.scan(slot.pids);
+		}
+		if (rates != NULL) {
+			rates->compute(slot.pids, slot.node_time);
+		}
+		filter.apply(slot.pids);
+		queue.push();
+
+		Metrics::record(Metrics::CYCLE, Metrics::now() - cycle_start);
+		if (metrics_file.empty() == false) {
+			Metrics::writeFile(metrics_file);
+		}
+
+		if (interval > 0) {
+			sampler.done();
+			if (sampler.overran()) {
+				cerr << "Snapshot overran its " << interval << " ms interval: "
+						<< sampler << endl;
+			} else if (debug) {
+				cerr << sampler << endl;
+			}
+		}
+
 		if (attempt % 400 == 0) {
 			cerr << ".";
 		}
 	}
+
+	// What is still queued is stored before the spool is finished
+	queue.close();
+	delete store;
+	delete rates;
+
+	if (interval > 0) {
+		cerr << "Stopping after " << sampler << endl;
+	} else if (replay != NULL) {
+		replay->finish();
+	}
+	delete events;
+	delete replay;
+	delete uplink;
+	delete recording;
+	delete spool;
+
 	return EXIT_SUCCESS;
 }
 